@@ -0,0 +1,308 @@
+#include "cartridge.h"
+#include "../core/arm9/cpu.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Where the firmware leaves the header and card IDs in main RAM
+static constexpr uint32_t BOOT_HEADER = 0x027FFE00;
+static constexpr uint32_t BOOT_HEADER_SIZE = 0x170;
+static constexpr uint32_t BOOT_CHIP_ID = 0x027FF800;
+static constexpr uint32_t BOOT_CHIP_ID_2 = 0x027FFC00;
+static constexpr uint32_t BOOT_FROM_CARD = 0x027FFC40;
+
+// AUXSPICNT (0x040001A0) bit 14: IRQ when a card transfer completes
+static constexpr uint32_t AUXSPICNT_HI = 0x040001A1;
+static constexpr uint8_t AUX_TRANSFER_IRQ = 1 << 6;
+static constexpr uint32_t IRQ_CARD_TRANSFER = 1 << 19;
+
+static constexpr uint32_t CARD_COMMAND = 0x040001A8;
+static constexpr uint32_t CARD_DATA = 0x04100010;
+
+// The secure area (0x4000-0x7FFF) cannot be read with KEY2 data reads
+static constexpr uint32_t SECURE_AREA_END = 0x8000;
+
+static uint32_t readCtrl(void* ctx, uint32_t) {
+    return static_cast<Cartridge*>(ctx)->romctrl;
+}
+
+static void writeCtrl(void* ctx, uint32_t, uint32_t v) {
+    static_cast<Cartridge*>(ctx)->writeControl(v);
+}
+
+static uint32_t readDataPort(void* ctx, uint32_t) {
+    return static_cast<Cartridge*>(ctx)->readData();
+}
+
+Cartridge::~Cartridge() {
+    unload();
+}
+
+void Cartridge::init(Memory* memory) {
+    mem = memory;
+    mem->mmio.on<uint32_t>(0x040001A4, readCtrl, writeCtrl, this);
+    mem->mmio.onRead<uint32_t>(CARD_DATA, readDataPort, this);
+}
+
+void Cartridge::reset() {
+    romctrl = 0;
+    address = 0;
+    remaining = 0;
+    command = 0;
+}
+
+// ---------------- MAPPING ----------------
+
+#ifdef _WIN32
+
+bool Cartridge::load(const char* path) {
+    unload();
+
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        printf("Cartridge: cannot open %s\n", path);
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart < HEADER_SIZE) {
+        printf("Cartridge: %s is not an NDS ROM\n", path);
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    const void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (!view) {
+        printf("Cartridge: cannot map %s\n", path);
+        if (mapping) CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    fileHandle = file;
+    mappingHandle = mapping;
+    rom = (const uint8_t*)view;
+    romSize = (size_t)size.QuadPart;
+    return true;
+}
+
+void Cartridge::unload() {
+    if (rom) UnmapViewOfFile(rom);
+    if (mappingHandle) CloseHandle(mappingHandle);
+    if (fileHandle) CloseHandle(fileHandle);
+    rom = nullptr;
+    romSize = 0;
+    fileHandle = mappingHandle = nullptr;
+    reset();
+}
+
+#else
+
+bool Cartridge::load(const char* path) {
+    unload();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Cartridge: cannot open %s\n", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)HEADER_SIZE) {
+        printf("Cartridge: %s is not an NDS ROM\n", path);
+        close(fd);
+        return false;
+    }
+
+    // The mapping keeps the file alive; the descriptor is not needed
+    void* view = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED) {
+        printf("Cartridge: cannot map %s\n", path);
+        return false;
+    }
+
+    rom = (const uint8_t*)view;
+    romSize = (size_t)st.st_size;
+    return true;
+}
+
+void Cartridge::unload() {
+    if (rom) munmap((void*)rom, romSize);
+    rom = nullptr;
+    romSize = 0;
+    reset();
+}
+
+#endif
+
+// ---------------- HEADER ----------------
+
+uint32_t Cartridge::header32(uint32_t offset) const {
+    uint32_t v;
+    memcpy(&v, rom + offset, 4);
+    return v;
+}
+
+std::string Cartridge::title() const {
+    if (!loaded()) return {};
+    const char* s = (const char*)rom;
+    return std::string(s, strnlen(s, 12));
+}
+
+std::string Cartridge::gameCode() const {
+    if (!loaded()) return {};
+    const char* s = (const char*)rom + 0x0C;
+    return std::string(s, strnlen(s, 4));
+}
+
+Cartridge::Binary Cartridge::arm9() const {
+    if (!loaded()) return {};
+    return { header32(0x20), header32(0x24), header32(0x28), header32(0x2C) };
+}
+
+Cartridge::Binary Cartridge::arm7() const {
+    if (!loaded()) return {};
+    return { header32(0x30), header32(0x34), header32(0x38), header32(0x3C) };
+}
+
+uint32_t Cartridge::chipID() const {
+    uint32_t mib = (uint32_t)(romSize >> 20);
+    return 0xC2 | ((mib ? mib - 1 : 0) << 8);
+}
+
+// ---------------- BOOT ----------------
+
+// Stacks for IRQ, SVC and SYS mode; the core starts in SYS mode
+static void startAt(CPU& cpu, uint32_t entry, uint32_t irqSP, uint32_t svcSP, uint32_t sysSP) {
+    cpu.switchMode(CPU::MODE_IRQ);
+    cpu.R[13] = irqSP;
+    cpu.switchMode(CPU::MODE_SVC);
+    cpu.R[13] = svcSP;
+    cpu.switchMode(CPU::MODE_SYS);
+    cpu.R[13] = sysSP;
+    cpu.CPSR = CPU::MODE_SYS;
+
+    cpu.R[12] = cpu.R[14] = entry;
+    cpu.PC() = entry;
+}
+
+bool Cartridge::copyBinary(Memory& bus, const Binary& b) const {
+    if ((uint64_t)b.romOffset + b.size > romSize ||
+        (uint64_t)b.ramAddress + b.size > 0x100000000ull) {
+        printf("Cartridge: bad binary at ROM %08X (%u bytes)\n", b.romOffset, b.size);
+        return false;
+    }
+    if (!b.size) return true;
+
+    if (uint8_t* to = bus.hostRange(b.ramAddress, b.size, true)) {
+        memcpy(to, rom + b.romOffset, b.size);
+        return true;
+    }
+    for (uint32_t i = 0; i < b.size; i++)
+        bus.write8(b.ramAddress + i, rom[b.romOffset + i]);
+    return true;
+}
+
+bool Cartridge::boot(CPU& cpu9, CPU& cpu7) {
+    if (!loaded()) return false;
+
+    Memory& bus = *cpu9.mem;
+    Binary a9 = arm9();
+    Binary a7 = arm7();
+
+    cpu9.reset();
+    cpu7.reset();
+    reset();
+
+    // All shared WRAM goes to the ARM7, which may load its binary there
+    bus.write8(0x04000247, 3);
+
+    if (!copyBinary(bus, a9) || !copyBinary(*cpu7.mem, a7)) return false;
+
+    for (uint32_t i = 0; i < BOOT_HEADER_SIZE; i += 4)
+        bus.write32(BOOT_HEADER + i, header32(i));
+
+    uint32_t id = chipID();
+    bus.write32(BOOT_CHIP_ID, id);
+    bus.write32(BOOT_CHIP_ID + 4, id);
+    bus.write32(BOOT_CHIP_ID_2, id);
+    bus.write32(BOOT_CHIP_ID_2 + 4, id);
+    bus.write16(BOOT_FROM_CARD, 1);
+
+    // DTCM at 0x03000000 (16 KiB), ITCM and the high vectors on, as the
+    // firmware leaves them
+    cpu9.cp15.write(9, 1, 0, 0x0300000A);
+    cpu9.cp15.write(9, 1, 1, 0x00000020);
+    cpu9.cp15.write(1, 0, 0, cpu9.cp15.control | CP15::CTRL_HIGH_VECTORS |
+                             CP15::CTRL_DTCM_ENABLE | CP15::CTRL_ITCM_ENABLE);
+
+    startAt(cpu9, a9.entry, 0x03003F80, 0x03003FC0, 0x03002F7C);
+    startAt(cpu7, a7.entry, 0x0380FF80, 0x0380FFC0, 0x0380FD80);
+    return true;
+}
+
+// ---------------- DATA PORT ----------------
+
+void Cartridge::writeControl(uint32_t v) {
+    // Data-ready is status only; a transfer cannot be cancelled
+    romctrl = (romctrl & (CTRL_DATA_READY | CTRL_BUSY)) | (v & ~CTRL_DATA_READY);
+    if (!(v & CTRL_BUSY) || remaining) return;
+
+    const uint8_t* cmd = &mem->mmio.bytes[MMIO::offset(CARD_COMMAND)];
+    command = cmd[0];
+    address = (cmd[1] << 24) | (cmd[2] << 16) | (cmd[3] << 8) | cmd[4];
+
+    // Block size: none, 0x100 << n, or one word
+    uint32_t block = (v >> 24) & 7;
+    remaining = block == 0 ? 0 : block == 7 ? 4 : 0x100u << block;
+
+    if (command == 0xB7 && address < SECURE_AREA_END)
+        address = SECURE_AREA_END + (address & 0x1FF);
+
+    if (!remaining) {
+        finish();
+        return;
+    }
+
+    romctrl |= CTRL_DATA_READY;
+    mem->dma.trigger(DMA::START_CARTRIDGE);
+}
+
+uint32_t Cartridge::readData() {
+    if (!(romctrl & CTRL_DATA_READY)) return 0;
+
+    uint32_t v = 0xFFFFFFFF;
+    switch (command) {
+    case 0xB7:  // data read; wraps inside a 4 KiB page
+        if ((uint64_t)address + 4 <= romSize) memcpy(&v, rom + address, 4);
+        address = (address & ~0xFFFu) | ((address + 4) & 0xFFF);
+        break;
+    case 0xB8:  // chip ID
+        v = chipID();
+        break;
+    }
+
+    remaining -= 4;
+    if (remaining)
+        mem->dma.trigger(DMA::START_CARTRIDGE);
+    else
+        finish();
+    return v;
+}
+
+void Cartridge::finish() {
+    romctrl &= ~(CTRL_BUSY | CTRL_DATA_READY);
+    if ((mem->mmio.bytes[MMIO::offset(AUXSPICNT_HI)] & AUX_TRANSFER_IRQ) && mem->irq)
+        mem->irq->request(IRQ_CARD_TRANSFER);
+}
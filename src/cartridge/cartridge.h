@@ -0,0 +1,85 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+struct Memory;
+struct CPU;
+
+// NDS game card. The .nds file is mapped read-only and never copied as a
+// whole: header fields are read from the mapping when asked for, boot()
+// copies only the ARM9/ARM7 binaries into RAM, and card reads through
+// the data port come straight from the mapping. Large ROMs open at once,
+// and the OS shares their pages between instances.
+//
+// The card is left in the state the firmware hands over to the game
+// (KEY2 data mode), so only the commands used from then on are served.
+struct Cartridge {
+    static constexpr uint32_t HEADER_SIZE = 0x200;
+
+    // ROMCTRL (0x040001A4)
+    static constexpr uint32_t CTRL_DATA_READY = 1u << 23;
+    static constexpr uint32_t CTRL_BUSY = 1u << 31;
+
+    // One of the boot binaries, as described by the header
+    struct Binary {
+        uint32_t romOffset = 0;
+        uint32_t entry = 0;
+        uint32_t ramAddress = 0;
+        uint32_t size = 0;
+    };
+
+    Memory* mem = nullptr;
+
+    const uint8_t* rom = nullptr;   // the mapped file
+    size_t romSize = 0;
+
+    uint32_t romctrl = 0;
+    uint32_t address = 0;           // ROM offset of the next data word
+    uint32_t remaining = 0;         // bytes left in the running transfer
+    uint8_t command = 0;
+
+    Cartridge() = default;
+    ~Cartridge();
+
+    Cartridge(const Cartridge&) = delete;
+    Cartridge& operator=(const Cartridge&) = delete;
+
+    void init(Memory* memory);
+    void reset();
+
+    // Maps 'path'; false (with the card left empty) if it cannot be
+    // opened or is too small to hold a header
+    bool load(const char* path);
+    void unload();
+
+    bool loaded() const { return rom != nullptr; }
+
+    // Header fields, read from the mapping on each call
+    std::string title() const;
+    std::string gameCode() const;
+    Binary arm9() const;
+    Binary arm7() const;
+
+    // Chip ID as the card returns it: maker 0xC2, size in MiB - 1
+    uint32_t chipID() const;
+
+    // Direct boot: copies the header and binaries where the firmware
+    // leaves them and sets both cores up to start at their entry points
+    bool boot(CPU& cpu9, CPU& cpu7);
+
+    // Copies one binary over 'bus'; false if the header entry is bad
+    bool copyBinary(Memory& bus, const Binary& b) const;
+
+    void writeControl(uint32_t v);
+
+    // Next word of the running transfer (0x04100010)
+    uint32_t readData();
+
+private:
+    void* fileHandle = nullptr;     // Windows only
+    void* mappingHandle = nullptr;
+
+    uint32_t header32(uint32_t offset) const;
+    void finish();
+};
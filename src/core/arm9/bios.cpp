@@ -0,0 +1,398 @@
+#include "bios.h"
+#include "../arm9/cpu.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+// Flags the game's IRQ handler sets for IntrWait: at the end of DTCM on
+// the ARM9, at the end of WRAM on the ARM7
+static constexpr uint32_t IRQ_CHECK_FLAGS = 0x3FF8;
+static constexpr uint32_t IRQ_CHECK_FLAGS_ARM7 = 0x0380FFF8;
+
+// IRQ vector of the BIOS image, as in the real BIOS: save r0-r3, r12 and
+// lr, call the handler the game stored just above the check flags, and
+// return to the interrupted code with SUBS PC, LR, #4
+static constexpr uint32_t IRQ_VECTOR = 0x18;
+
+static constexpr uint32_t irqDispatchARM9[] = {
+    0xE92D500F,     // stmfd sp!, {r0-r3, r12, lr}
+    0xEE190F11,     // mrc p15, 0, r0, c9, c1, 0     DTCM base
+    0xE1A00620,     // mov r0, r0, lsr #12
+    0xE1A00600,     // mov r0, r0, lsl #12
+    0xE2800901,     // add r0, r0, #0x4000
+    0xE28FE000,     // add lr, pc, #0
+    0xE510F004,     // ldr pc, [r0, #-4]             DTCM + 0x3FFC
+    0xE8BD500F,     // ldmfd sp!, {r0-r3, r12, lr}
+    0xE25EF004,     // subs pc, lr, #4
+};
+
+static constexpr uint32_t irqDispatchARM7[] = {
+    0xE92D500F,     // stmfd sp!, {r0-r3, r12, lr}
+    0xE3A00301,     // mov r0, #0x04000000
+    0xE28FE000,     // add lr, pc, #0
+    0xE510F004,     // ldr pc, [r0, #-4]             0x03FFFFFC = 0x0380FFFC
+    0xE8BD500F,     // ldmfd sp!, {r0-r3, r12, lr}
+    0xE25EF004,     // subs pc, lr, #4
+};
+
+// CpuSet/CpuFastSet control word (r2)
+static constexpr uint32_t SET_COUNT = 0x001FFFFF;
+static constexpr uint32_t SET_FILL = 1 << 24;
+static constexpr uint32_t SET_WORD = 1 << 26;
+
+// Byte-at-a-time table for the BIOS CRC-16 (reflected 0x8005)
+static constexpr std::array<uint16_t, 256> buildCRCTable() {
+    std::array<uint16_t, 256> t{};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint16_t crc = (uint16_t)i;
+        for (int b = 0; b < 8; b++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        t[i] = crc;
+    }
+    return t;
+}
+
+static constexpr std::array<uint16_t, 256> crcTable = buildCRCTable();
+
+// Sequential reader over guest memory: one host pointer per page, bus
+// reads where there is none
+struct GuestReader {
+    Memory* mem;
+    uint32_t addr;
+    const uint8_t* p = nullptr;
+    uint32_t left = 0;
+
+    GuestReader(Memory* m, uint32_t a) : mem(m), addr(a) {}
+
+    uint8_t byte() {
+        if (!left) {
+            left = Memory::PAGE_SIZE - (addr & Memory::PAGE_MASK);
+            p = mem->hostSpan(addr, left, false);
+            if (!p) {
+                left = 0;
+                return mem->read8(addr++);
+            }
+        }
+        left--;
+        addr++;
+        return *p++;
+    }
+
+    uint32_t word() {
+        uint32_t v = byte();
+        v |= byte() << 8;
+        v |= byte() << 16;
+        return v | ((uint32_t)byte() << 24);
+    }
+};
+
+void BIOS::init(CPU* c) {
+    cpu = c;
+
+    // Calls never reach the image; IRQs do, through the vector
+    uint8_t* image = cpu->mem->bios;
+    if (cpu->model == CPU::ARM9)
+        memcpy(image + IRQ_VECTOR, irqDispatchARM9, sizeof(irqDispatchARM9));
+    else
+        memcpy(image + IRQ_VECTOR, irqDispatchARM7, sizeof(irqDispatchARM7));
+}
+
+bool BIOS::call(uint32_t n) {
+    switch (n) {
+    case 0x04: intrWait(cpu->R[0] & 1, cpu->R[1]); return true;    // IntrWait
+    case 0x05: intrWait(true, 1); return true;                      // VBlankIntrWait
+    case 0x06: halt(); return true;                                 // Halt
+    case 0x09: div(); return true;                                  // Div
+    case 0x0B: cpuSet(); return true;                               // CpuSet
+    case 0x0C: cpuFastSet(); return true;                           // CpuFastSet
+    case 0x0D: sqrt(); return true;                                 // Sqrt
+    case 0x0E: crc16(); return true;                                // GetCRC16
+    case 0x11: lz77(false); return true;                            // LZ77UnCompReadNormalWrite8bit
+    case 0x12: lz77(true); return true;                             // LZ77UnCompReadByCallbackWrite16bit
+    case 0x13: huffman(); return true;                              // HuffUnCompReadByCallback
+    case 0x14: rle(false); return true;                             // RLUnCompReadNormalWrite8bit
+    case 0x15: rle(true); return true;                              // RLUnCompReadByCallbackWrite16bit
+    }
+    return false;
+}
+
+// ---------------- WAIT ----------------
+
+// Sleeps until IE & IF; the run loop skips ahead to the next event
+void BIOS::halt() {
+    IRQ& irq = cpu->irq;
+    cpu->halted = !(irq.IE & irq.IF);
+}
+
+// Waits for one of the IRQs in 'mask' to be flagged by the handler. The
+// SWI is re-run after every wake-up, with 'discard' off, until it is;
+// VBlankIntrWait passes it again, so 'waiting' overrides it there.
+void BIOS::intrWait(bool discard, uint32_t mask) {
+    Memory* mem = cpu->mem;
+    uint32_t addr = cpu->model == CPU::ARM7 ? IRQ_CHECK_FLAGS_ARM7
+                                            : mem->dtcmRegion.base + IRQ_CHECK_FLAGS;
+
+    cpu->irq.write(0x04000208, 1);  // IME = 1
+
+    uint32_t flags = mem->read32(addr);
+    if (discard && !waiting) {
+        mem->write32(addr, flags & ~mask);
+    }
+    else if (flags & mask) {
+        mem->write32(addr, flags & ~mask);
+        waiting = false;
+        return;
+    }
+
+    waiting = true;
+    cpu->R[0] = 0;
+    cpu->R[1] = mask;
+    cpu->PC() -= cpu->getFlag(CPU::T) ? 2 : 4;
+    halt();
+}
+
+// ---------------- MATH ----------------
+
+// r0 / r1 (signed): r0 = quotient, r1 = remainder, r3 = |quotient|
+void BIOS::div() {
+    int32_t num = (int32_t)cpu->R[0];
+    int32_t den = (int32_t)cpu->R[1];
+
+    if (den == 0) {
+        // no quotient exists: return -1 or +1 by the sign of r0, with r0
+        // itself as the remainder
+        cpu->R[0] = num < 0 ? 0xFFFFFFFF : 1;
+        cpu->R[1] = (uint32_t)num;
+        cpu->R[3] = 1;
+        return;
+    }
+    if (num == INT32_MIN && den == -1) {
+        cpu->R[0] = (uint32_t)INT32_MIN;
+        cpu->R[1] = 0;
+        cpu->R[3] = 0x80000000;
+        return;
+    }
+
+    int32_t q = num / den;
+    cpu->R[0] = (uint32_t)q;
+    cpu->R[1] = (uint32_t)(num % den);
+    cpu->R[3] = q < 0 ? 0u - (uint32_t)q : (uint32_t)q;
+}
+
+// r0 = floor(sqrt(r0)), unsigned
+void BIOS::sqrt() {
+    uint32_t v = cpu->R[0];
+    uint32_t r = 0;
+    for (uint32_t bit = 1u << 30; bit; bit >>= 2) {
+        if (v >= r + bit) {
+            v -= r + bit;
+            r = (r >> 1) + bit;
+        }
+        else {
+            r >>= 1;
+        }
+    }
+    cpu->R[0] = r;
+}
+
+// r0 = CRC-16 of r2 bytes at r1, starting from r0 (halfword steps)
+void BIOS::crc16() {
+    uint16_t crc = (uint16_t)cpu->R[0];
+    uint32_t addr = cpu->R[1] & ~1u;
+    uint32_t len = cpu->R[2] & ~1u;
+
+    GuestReader in(cpu->mem, addr);
+    for (uint32_t i = 0; i < len; i++)
+        crc = (crc >> 8) ^ crcTable[(crc ^ in.byte()) & 0xFF];
+
+    cpu->R[0] = crc;
+}
+
+// ---------------- COPY / FILL ----------------
+
+// r0 = source, r1 = destination, r2 = count | fill | 32-bit
+void BIOS::cpuSet() {
+    Memory* mem = cpu->mem;
+    uint32_t ctl = cpu->R[2];
+    uint32_t count = ctl & SET_COUNT;
+    uint32_t size = (ctl & SET_WORD) ? 4 : 2;
+    uint32_t src = cpu->R[0] & ~(size - 1);
+    uint32_t dst = cpu->R[1] & ~(size - 1);
+    bool fill = ctl & SET_FILL;
+    if (!count) return;
+
+    uint8_t* to = mem->hostRange(dst, count * size, true);
+    uint8_t* from = mem->hostRange(src, fill ? size : count * size, false);
+
+    if (to && from) {
+        if (!fill) {
+            memmove(to, from, (size_t)count * size);
+        }
+        else if (size == 4) {
+            uint32_t v;
+            memcpy(&v, from, 4);
+            std::fill_n((uint32_t*)to, count, v);
+        }
+        else {
+            uint16_t v;
+            memcpy(&v, from, 2);
+            std::fill_n((uint16_t*)to, count, v);
+        }
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t s = fill ? src : src + i * size;
+        if (size == 4) mem->write32(dst + i * 4, mem->read32(s));
+        else mem->write16(dst + i * 2, mem->read16(s));
+    }
+}
+
+// CpuSet for words, with the count rounded up to a multiple of 8
+void BIOS::cpuFastSet() {
+    uint32_t ctl = cpu->R[2];
+    uint32_t count = ((ctl & SET_COUNT) + 7) & ~7u;
+
+    uint32_t saved = cpu->R[2];
+    cpu->R[2] = (ctl & SET_FILL) | SET_WORD | count;
+    cpuSet();
+    cpu->R[2] = saved;
+}
+
+// ---------------- DECOMPRESSION ----------------
+// Every format starts with a word holding the decompressed size in bits
+// 8-31. Output is built in 'scratch' and stored in one go. The callback
+// variants (0x12, 0x13, 0x15) read the source straight from memory at r0,
+// which is what the usual memory-backed callbacks do.
+
+void BIOS::flush(uint32_t dst, bool write16) {
+    Memory* mem = cpu->mem;
+    uint32_t len = (uint32_t)scratch.size();
+    if (write16) len &= ~1u;
+    if (!len) return;
+
+    if (uint8_t* to = mem->hostRange(dst, len, true)) {
+        memcpy(to, scratch.data(), len);
+        return;
+    }
+
+    if (write16) {
+        for (uint32_t i = 0; i < len; i += 2)
+            mem->write16(dst + i, scratch[i] | (scratch[i + 1] << 8));
+    }
+    else {
+        for (uint32_t i = 0; i < len; i++)
+            mem->write8(dst + i, scratch[i]);
+    }
+}
+
+void BIOS::lz77(bool write16) {
+    GuestReader in(cpu->mem, cpu->R[0]);
+    uint32_t size = in.word() >> 8;
+
+    scratch.clear();
+    scratch.reserve(size);
+
+    while (scratch.size() < size) {
+        uint8_t flags = in.byte();
+        for (int i = 0; i < 8 && scratch.size() < size; i++, flags <<= 1) {
+            if (!(flags & 0x80)) {
+                scratch.push_back(in.byte());
+                continue;
+            }
+
+            uint8_t b0 = in.byte();
+            uint8_t b1 = in.byte();
+            uint32_t len = (b0 >> 4) + 3;
+            uint32_t disp = (((b0 & 0xF) << 8) | b1) + 1;
+
+            // byte by byte: the window may overlap what is being written
+            for (uint32_t j = 0; j < len && scratch.size() < size; j++) {
+                size_t from = scratch.size() >= disp ? scratch.size() - disp : 0;
+                scratch.push_back(scratch.size() >= disp ? scratch[from] : 0);
+            }
+        }
+    }
+
+    flush(cpu->R[1], write16);
+}
+
+void BIOS::rle(bool write16) {
+    GuestReader in(cpu->mem, cpu->R[0]);
+    uint32_t size = in.word() >> 8;
+
+    scratch.clear();
+    scratch.reserve(size);
+
+    while (scratch.size() < size) {
+        uint8_t flag = in.byte();
+        if (flag & 0x80) {
+            uint32_t len = std::min<uint32_t>((flag & 0x7F) + 3, size - (uint32_t)scratch.size());
+            scratch.insert(scratch.end(), len, in.byte());
+        }
+        else {
+            uint32_t len = (flag & 0x7F) + 1;
+            for (uint32_t j = 0; j < len && scratch.size() < size; j++)
+                scratch.push_back(in.byte());
+        }
+    }
+
+    flush(cpu->R[1], write16);
+}
+
+// Tree nodes: bits 0-5 offset to the child pair, bit 7/6 set when the
+// left/right child is a data leaf. The bit stream comes in words, MSB
+// first; 4- or 8-bit symbols are packed into words, LSB first.
+void BIOS::huffman() {
+    Memory* mem = cpu->mem;
+    uint32_t src = cpu->R[0];
+
+    GuestReader in(mem, src);
+    uint32_t header = in.word();
+    uint32_t bits = header & 0xF;
+    uint32_t size = header >> 8;
+    if (bits != 4 && bits != 8) bits = 8;
+
+    // The tree is small; read it once
+    uint32_t treeSize = (in.byte() + 1) * 2;
+    std::vector<uint8_t> tree(treeSize);
+    tree[0] = 0;
+    for (uint32_t i = 1; i < treeSize; i++) tree[i] = in.byte();
+    // tree[0] is the size byte; the root node is tree[1]
+
+    scratch.clear();
+    scratch.reserve(size);
+
+    uint32_t node = 1;
+    uint32_t out = 0, outBits = 0;
+
+    while (scratch.size() < size) {
+        uint32_t word = in.word();
+        for (int i = 31; i >= 0 && scratch.size() < size; i--) {
+            uint32_t bit = (word >> i) & 1;
+            uint8_t v = tree[node];
+            uint32_t child = (node & ~1u) + (v & 0x3F) * 2 + 2 + bit;
+            if (child >= treeSize) child = treeSize - 1;
+
+            if (!(v & (bit ? 0x40 : 0x80))) {
+                node = child;
+                continue;
+            }
+
+            out |= (tree[child] & ((1u << bits) - 1)) << outBits;
+            outBits += bits;
+            node = 1;
+
+            if (outBits == 32) {
+                for (int b = 0; b < 4 && scratch.size() < size; b++)
+                    scratch.push_back((uint8_t)(out >> (b * 8)));
+                out = 0;
+                outBits = 0;
+            }
+        }
+    }
+
+    // Huffman output is stored in words
+    scratch.resize(size & ~3u);
+    flush(cpu->R[1] & ~3u, true);
+}
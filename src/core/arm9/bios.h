@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+struct CPU;
+
+// High-level BIOS: SWI calls run as native code instead of jumping into
+// a BIOS image, and return straight to the caller. The copy, fill and
+// decompression calls work on host memory whenever the guest range is
+// plain memory, and fall back to bus accesses otherwise. The only code
+// in the image is the IRQ dispatcher at the IRQ vector.
+struct BIOS {
+    CPU* cpu = nullptr;
+
+    void init(CPU* c);
+
+    // Runs SWI 'n'; false if it is not implemented
+    bool call(uint32_t n);
+
+private:
+    std::vector<uint8_t> scratch;   // decompression output
+    bool waiting = false;           // IntrWait halted, to be re-run
+
+    void halt();
+    void intrWait(bool discard, uint32_t mask);
+
+    void div();
+    void sqrt();
+    void crc16();
+    void cpuSet();
+    void cpuFastSet();
+
+    void lz77(bool write16);
+    void rle(bool write16);
+    void huffman();
+
+    // Copies 'scratch' to guest memory in 8- or 16-bit units
+    void flush(uint32_t dst, bool write16);
+};
@@ -0,0 +1,132 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Page-granular map of memory that holds cached code, by physical
+// address (Memory::physical), so every alias of a page shares one entry.
+// Memory checks hasCode() on writes and calls invalidate() on a hit.
+struct CodeTracker {
+    static constexpr uint32_t PAGE_SHIFT = 12;
+    static constexpr uint32_t PAGE_COUNT = 1u << (32 - PAGE_SHIFT);
+
+    std::vector<uint8_t> pages = std::vector<uint8_t>(PAGE_COUNT, 0);
+
+    // Called when a page gains (true) or loses (false) its last block
+    std::function<void(uint32_t page, bool hasCode)> onCodePage;
+
+    virtual ~CodeTracker() = default;
+
+    inline bool hasCode(uint32_t addr) const {
+        return pages[addr >> PAGE_SHIFT];
+    }
+
+    // Retires every block that overlaps [addr, addr + size)
+    virtual void invalidate(uint32_t addr, uint32_t size) = 0;
+    virtual void invalidateAll() = 0;
+};
+
+// Predecoded blocks keyed by guest PC (bit 0 set for Thumb blocks).
+// Invalidated blocks are retired instead of freed so a block that
+// overwrites itself can finish its current instruction safely.
+template <typename Op>
+struct BlockCache : CodeTracker {
+
+    struct Block {
+        uint32_t key = 0;
+        uint32_t start = 0;
+        uint32_t end = 0;       // one past the last byte
+        uint32_t phys = 0;      // physical address of 'start'
+        bool valid = true;
+        bool idle = false;      // loops on itself without side effects
+        std::vector<Op> ops;
+        void* native = nullptr; // translated host code, if any
+    };
+
+    std::unordered_map<uint32_t, std::unique_ptr<Block>> blocks;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> pageBlocks;
+    std::vector<std::unique_ptr<Block>> retired;
+
+    // Called for every block as it is invalidated
+    std::function<void(Block&)> onRetire;
+
+    Block* find(uint32_t key) {
+        auto it = blocks.find(key);
+        return it != blocks.end() ? it->second.get() : nullptr;
+    }
+
+    Block* insert(std::unique_ptr<Block> b) {
+        Block* raw = b.get();
+        for (uint32_t p = firstPage(*raw); p <= lastPage(*raw); p++) {
+            pageBlocks[p].push_back(raw->key);
+            if (!pages[p]) setPage(p, 1);
+        }
+        blocks[raw->key] = std::move(b);
+        return raw;
+    }
+
+    // 'addr' is a physical address. A store wider than an instruction
+    // can change one that starts after its first byte, so the whole
+    // range is checked.
+    void invalidate(uint32_t addr, uint32_t size) override {
+        uint32_t last = addr + size - 1;
+        for (uint32_t p = addr >> PAGE_SHIFT; p <= last >> PAGE_SHIFT; p++) {
+            auto it = pageBlocks.find(p);
+            if (it == pageBlocks.end()) continue;
+
+            // Copy: retire() edits the per-page lists
+            std::vector<uint32_t> keys = it->second;
+            for (uint32_t key : keys) {
+                Block* b = find(key);
+                if (b && addr < b->phys + (b->end - b->start) && last >= b->phys)
+                    retire(key);
+            }
+        }
+    }
+
+    void invalidateAll() override {
+        for (auto& [key, b] : blocks) {
+            b->valid = false;
+            if (onRetire) onRetire(*b);
+            retired.push_back(std::move(b));
+        }
+        for (auto& [page, keys] : pageBlocks)
+            setPage(page, 0);
+        blocks.clear();
+        pageBlocks.clear();
+    }
+
+    void releaseRetired() {
+        retired.clear();
+    }
+
+private:
+    void setPage(uint32_t p, uint8_t v) {
+        pages[p] = v;
+        if (onCodePage) onCodePage(p, v != 0);
+    }
+
+    static uint32_t firstPage(const Block& b) { return b.phys >> PAGE_SHIFT; }
+    static uint32_t lastPage(const Block& b) { return (b.phys + (b.end - b.start) - 1) >> PAGE_SHIFT; }
+
+    void retire(uint32_t key) {
+        auto it = blocks.find(key);
+        Block* b = it->second.get();
+
+        for (uint32_t p = firstPage(*b); p <= lastPage(*b); p++) {
+            auto& keys = pageBlocks[p];
+            std::erase(keys, key);
+            if (keys.empty()) {
+                pageBlocks.erase(p);
+                setPage(p, 0);
+            }
+        }
+
+        b->valid = false;
+        if (onRetire) onRetire(*b);
+        retired.push_back(std::move(it->second));
+        blocks.erase(it);
+    }
+};
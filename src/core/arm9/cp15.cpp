@@ -0,0 +1,61 @@
+#include "cp15.h"
+#include "../memory/memory.h"
+
+static constexpr uint32_t ID_MAIN = 0x41059461;       // ARM946E-S
+static constexpr uint32_t ID_CACHE = 0x0F0D2112;      // 8 KiB I-cache, 4 KiB D-cache
+static constexpr uint32_t ID_TCM = 0x00140180;        // 32 KiB ITCM, 16 KiB DTCM
+
+static constexpr uint32_t CTRL_FIXED = 0x00000078;    // bits 3-6 read as one
+static constexpr uint32_t CTRL_WRITABLE = 0x000FF085;
+
+// Virtual region size: 512 << N, with N in bits 1-5
+static uint32_t regionSize(uint32_t reg) {
+    uint32_t n = (reg >> 1) & 0x1F;
+    return n >= 23 ? 0 : 512u << n;
+}
+
+void CP15::init(Memory* memory) {
+    mem = memory;
+}
+
+void CP15::reset() {
+    control = CTRL_FIXED;
+    dtcmReg = 0;
+    itcmReg = 0;
+    applyTCM();
+}
+
+uint32_t CP15::read(uint32_t cn, uint32_t cm, uint32_t op2) const {
+    switch ((cn << 8) | (cm << 4) | op2) {
+    case 0x000: return ID_MAIN;
+    case 0x001: return ID_CACHE;
+    case 0x002: return ID_TCM;
+    case 0x100: return control;
+    case 0x910: return dtcmReg;
+    case 0x911: return itcmReg;
+    }
+    return 0;
+}
+
+void CP15::write(uint32_t cn, uint32_t cm, uint32_t op2, uint32_t v) {
+    switch ((cn << 8) | (cm << 4) | op2) {
+    case 0x100:
+        control = (v & CTRL_WRITABLE) | CTRL_FIXED;
+        applyTCM();
+        break;
+    case 0x910:
+        dtcmReg = v & 0xFFFFF03E;
+        applyTCM();
+        break;
+    case 0x911:
+        itcmReg = v & 0x0000003E;
+        applyTCM();
+        break;
+    }
+}
+
+void CP15::applyTCM() {
+    if (!mem) return;
+    mem->setTCM(control & CTRL_ITCM_ENABLE, regionSize(itcmReg),
+                control & CTRL_DTCM_ENABLE, dtcmReg & 0xFFFFF000, regionSize(dtcmReg));
+}
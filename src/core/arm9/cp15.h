@@ -0,0 +1,30 @@
+#pragma once
+#include <cstdint>
+
+struct Memory;
+
+// ARM946E-S system control coprocessor. Only what the DS uses is kept:
+// the ID registers, the control register and the TCM region registers.
+// Cache and protection unit operations are accepted and ignored.
+struct CP15 {
+    // Control register bits
+    static constexpr uint32_t CTRL_HIGH_VECTORS = 1 << 13;
+    static constexpr uint32_t CTRL_DTCM_ENABLE = 1 << 16;
+    static constexpr uint32_t CTRL_ITCM_ENABLE = 1 << 18;
+
+    Memory* mem = nullptr;
+
+    uint32_t control = 0;
+    uint32_t dtcmReg = 0;       // c9,c1,0: base | size << 1
+    uint32_t itcmReg = 0;       // c9,c1,1: size << 1 (base is fixed at 0)
+
+    void init(Memory* memory);
+    void reset();
+
+    // MRC/MCR p15, 0, Rd, cn, cm, op2
+    uint32_t read(uint32_t cn, uint32_t cm, uint32_t op2) const;
+    void write(uint32_t cn, uint32_t cm, uint32_t op2, uint32_t v);
+
+private:
+    void applyTCM();
+};
@@ -1,8 +1,16 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <cstdint>
 #include <cstdio>
+#include <utility>
 #include "../memory/memory.h"
 #include "../arm9/irq.h"
+#include "../arm9/cp15.h"
+#include "../arm9/bios.h"
+#include "../arm9/block_cache.h"
+#include "../jit/jit.h"
 #include "../src/utils/bit_utils.h"
 
 struct CPU {
@@ -13,27 +21,64 @@ struct CPU {
     uint32_t R[16];     // R0-R15
     uint32_t CPSR;      // Current Program Status Register
     Memory* mem;
+
+    // The same core serves both CPUs. The ARM7TDMI (ARMv4T) has no CP15,
+    // no BLX and no interworking on loads into PC, and runs at half the
+    // ARM9 clock.
+    enum Model {
+        ARM9,
+        ARM7
+    };
+
+    const Model model;
     IRQ irq;
+    CP15 cp15;
+    BIOS bios;
+
+    // Asleep until IE & IF (BIOS Halt/IntrWait); cleared by IRQ::update
+    bool halted = false;
 
     enum FLAGS {
         N = 1 << 31,
         Z = 1 << 30,
         C = 1 << 29,
         V = 1 << 28,
+        I = 1 << 7,
+        F = 1 << 6,
         T = 1 << 5
     };
 
-    CPU(Memory* memory) : mem(memory) {
+    CPU(Memory* memory, Model m = ARM9)
+        : mem(memory), model(m), coreCycle(m == ARM7 ? 2 : 1) {
         irq.init(this);
+        if (model == ARM9) cp15.init(mem);
+        bios.init(this);
 		mem->attachIRQ(&irq);
+        mem->attachCodeTracker(&blocks);
+        blocks.onRetire = [this](Block& b) {
+            if (b.native) jit.unlink(b.key);
+        };
         reset();
     }
 
+    ~CPU() {
+        if (mem->code == &blocks) mem->attachCodeTracker(nullptr);
+        mem->scheduler.clearHandler(Scheduler::IRQ, &irq);
+    }
+
     void reset() {
         irq.reset();
+        cp15.reset();
         for (auto& r : R) r = 0;
-        CPSR = 0;
+        for (int i = 0; i < 6; i++) bankR13[i] = bankR14[i] = bankSPSR[i] = 0;
+        for (auto& r : bankFIQ) r = 0;
+        CPSR = (uint32_t)MODE_SVC | I | F;
+        nzPending = 0;
+        cvOp = CV_NONE;
         PC() = 0;
+        halted = false;
+        idleLoop = false;
+        blocks.invalidateAll();
     }
 
     inline uint32_t& PC() { return R[15]; }
@@ -41,18 +86,285 @@ struct CPU {
     // -------------------------------------------------
     // FLAGS
     // -------------------------------------------------
+    // Flags are evaluated lazily. setNZ only records the result, and
+    // add/sub record their operands; CPSR is brought up to date when
+    // checkCond, MRS/MSR or an exception entry needs it.
+    enum LAZY_CV {
+        CV_NONE = 0,
+        CV_ADD = 1,
+        CV_SUB = 2
+    };
+
+    uint32_t lazyNZ = 0;    // N/Z source while nzPending is set
+    uint32_t lazyA = 0;     // C/V operands while cvOp != CV_NONE
+    uint32_t lazyB = 0;
+    uint8_t nzPending = 0;
+    uint8_t cvOp = CV_NONE;
+
+    inline uint32_t pendingCV() const {
+        uint32_t a = lazyA, b = lazyB;
+        if (cvOp == CV_ADD) {
+            uint32_t r = a + b;
+            return (r < a ? C : 0) | (((~(a ^ b) & (a ^ r)) >> 31) ? V : 0);
+        }
+        uint32_t r = a - b;
+        return (a >= b ? C : 0) | ((((a ^ b) & (a ^ r)) >> 31) ? V : 0);
+    }
+
+    // CPSR with any pending flags folded in
+    inline uint32_t readCPSR() const {
+        uint32_t v = CPSR;
+        if (nzPending)
+            v = (v & ~(N | Z)) | (lazyNZ & N) | (lazyNZ ? 0 : Z);
+        if (cvOp != CV_NONE)
+            v = (v & ~(C | V)) | pendingCV();
+        return v;
+    }
+
+    inline void resolveFlags() {
+        CPSR = readCPSR();
+        nzPending = 0;
+        cvOp = CV_NONE;
+    }
+
     inline void setFlag(uint32_t f, bool v) {
+        if ((f & (N | Z)) && nzPending) {
+            CPSR = (CPSR & ~(N | Z)) | (lazyNZ & N) | (lazyNZ ? 0 : Z);
+            nzPending = 0;
+        }
+        if ((f & (C | V)) && cvOp != CV_NONE) {
+            CPSR = (CPSR & ~(C | V)) | pendingCV();
+            cvOp = CV_NONE;
+        }
         if (v) CPSR |= f;
         else CPSR &= ~f;
     }
 
     inline bool getFlag(uint32_t f) const {
+        if (f & (N | Z | C | V)) return readCPSR() & f;
         return CPSR & f;
     }
 
     inline void setNZ(uint32_t v) {
-        setFlag(Z, v == 0);
-        setFlag(N, v & 0x80000000);
+        lazyNZ = v;
+        nzPending = 1;
+    }
+
+    // -------------------------------------------------
+    // MODES / EXCEPTIONS
+    // -------------------------------------------------
+    enum MODE {
+        MODE_USR = 0x10,
+        MODE_FIQ = 0x11,
+        MODE_IRQ = 0x12,
+        MODE_SVC = 0x13,
+        MODE_ABT = 0x17,
+        MODE_UND = 0x1B,
+        MODE_SYS = 0x1F
+    };
+
+    // Banked R13/R14/SPSR per bank (USR and SYS share bank 0) and the
+    // R8-R12 set that is not live. The current mode's registers are in R.
+    uint32_t bankR13[6];
+    uint32_t bankR14[6];
+    uint32_t bankSPSR[6];
+    uint32_t bankFIQ[5];
+
+    static int bankOf(uint32_t mode) {
+        switch (mode & 0x1F) {
+        case MODE_FIQ: return 1;
+        case MODE_IRQ: return 2;
+        case MODE_SVC: return 3;
+        case MODE_ABT: return 4;
+        case MODE_UND: return 5;
+        default:       return 0;
+        }
+    }
+
+    inline uint32_t mode() const { return CPSR & 0x1F; }
+    inline bool hasSPSR() const { return bankOf(CPSR) != 0; }
+    inline uint32_t& SPSR() { return bankSPSR[bankOf(CPSR)]; }
+
+    void switchMode(uint32_t newMode) {
+        int from = bankOf(CPSR), to = bankOf(newMode);
+
+        if (from != to) {
+            bankR13[from] = R[13];
+            bankR14[from] = R[14];
+            R[13] = bankR13[to];
+            R[14] = bankR14[to];
+
+            if ((from == 1) != (to == 1))
+                for (int i = 0; i < 5; i++) std::swap(R[8 + i], bankFIQ[i]);
+        }
+
+        CPSR = (CPSR & ~0x1Fu) | (newMode & 0x1F);
+    }
+
+    // 0xFFFF0000 when CP15 selects the high vectors (ARM9 only)
+    uint32_t vectorBase() const {
+        return model == ARM9 && (cp15.control & CP15::CTRL_HIGH_VECTORS) ? 0xFFFF0000 : 0;
+    }
+
+    // Saves CPSR into the new mode's SPSR, enters it in ARM state with
+    // IRQs masked and jumps to the vector
+    void enterException(uint32_t newMode, uint32_t vector, uint32_t lr) {
+        resolveFlags();
+        uint32_t old = CPSR;
+
+        switchMode(newMode);
+        SPSR() = old;
+        CPSR = (CPSR | I) & ~T;
+        if (newMode == MODE_FIQ) CPSR |= F;
+
+        R[14] = lr;
+        PC() = vector;
+        irq.update();
+    }
+
+    // CPSR = SPSR, for MOVS/SUBS PC and LDM with the S bit
+    void restoreCPSR() {
+        if (!hasSPSR()) return;
+
+        uint32_t v = SPSR();
+        nzPending = 0;
+        cvOp = CV_NONE;
+        switchMode(v);
+        CPSR = v;
+        irq.update();
+    }
+
+    // -------------------------------------------------
+    // ALU HELPERS
+    // -------------------------------------------------
+    enum SHIFT {
+        LSL = 0,
+        LSR = 1,
+        ASR = 2,
+        ROR = 3
+    };
+
+    // Shift by a register amount: 0 leaves value and carry untouched
+    static uint32_t shiftReg(uint32_t type, uint32_t v, uint32_t amount, bool& carry) {
+        if (amount == 0) return v;
+
+        switch (type) {
+        case LSL:
+            if (amount < 32) { carry = (v >> (32 - amount)) & 1; return v << amount; }
+            carry = amount == 32 && (v & 1);
+            return 0;
+        case LSR:
+            if (amount < 32) { carry = (v >> (amount - 1)) & 1; return v >> amount; }
+            carry = amount == 32 && (v >> 31);
+            return 0;
+        case ASR:
+            if (amount < 32) { carry = ((int32_t)v >> (amount - 1)) & 1; return (int32_t)v >> amount; }
+            carry = v >> 31;
+            return (int32_t)v >> 31;
+        default:
+            amount &= 31;
+            if (amount) v = (v >> amount) | (v << (32 - amount));
+            carry = v >> 31;
+            return v;
+        }
+    }
+
+    // Shift by an immediate amount: #0 encodes LSR/ASR #32 and RRX
+    static uint32_t shiftImm(uint32_t type, uint32_t v, uint32_t amount, bool& carry) {
+        if (amount == 0) {
+            if (type == LSL) return v;
+            if (type != ROR) return shiftReg(type, v, 32, carry);
+
+            bool c = carry;
+            carry = v & 1;
+            return (v >> 1) | ((uint32_t)c << 31);
+        }
+        return shiftReg(type, v, amount, carry);
+    }
+
+    // a + b + carry, setting NZCV
+    uint32_t addWithFlags(uint32_t a, uint32_t b, bool carry = false) {
+        if (!carry) {
+            setNZ(a + b);
+            lazyA = a;
+            lazyB = b;
+            cvOp = CV_ADD;
+            return a + b;
+        }
+
+        uint64_t r = (uint64_t)a + b + carry;
+        uint32_t r32 = (uint32_t)r;
+        setNZ(r32);
+        setFlag(C, r >> 32);
+        setFlag(V, (~(a ^ b) & (a ^ r32)) >> 31);
+        return r32;
+    }
+
+    // a - b - !carry, setting NZCV
+    uint32_t subWithFlags(uint32_t a, uint32_t b, bool carry = true) {
+        if (carry) {
+            setNZ(a - b);
+            lazyA = a;
+            lazyB = b;
+            cvOp = CV_SUB;
+            return a - b;
+        }
+
+        uint32_t borrow = 1;
+        uint32_t r = a - b - borrow;
+        setNZ(r);
+        setFlag(C, (uint64_t)a >= (uint64_t)b + borrow);
+        setFlag(V, ((a ^ b) & (a ^ r)) >> 31);
+        return r;
+    }
+
+    // -------------------------------------------------
+    // CYCLES
+    // -------------------------------------------------
+    // Instructions charge the scheduler clock as they run, so a timer
+    // read or an event raised halfway through a slice sees the current
+    // time. Each one takes a core cycle, plus:
+    //   - the region's wait states for every data access,
+    //   - an internal cycle for a load or a register-specified shift,
+    //   - the multiplier's internal cycles,
+    //   - a pipeline refill when it writes PC.
+    // Fetches are taken to hit the cache or a TCM and cost nothing more.
+    static constexpr uint32_t REFILL_CYCLES = 2;
+
+    const uint32_t coreCycle;   // ARM9 cycles per core cycle
+
+    inline void addCycles(uint32_t n) {
+        mem->scheduler.now += n * coreCycle;
+    }
+
+    template <typename T>
+    T busRead(uint32_t addr) {
+        mem->scheduler.now += mem->accessCycles<T>(addr);
+        return mem->read<T>(addr);
+    }
+
+    template <typename T>
+    void busWrite(uint32_t addr, T v) {
+        mem->scheduler.now += mem->accessCycles<T>(addr);
+        mem->write<T>(addr, v);
+    }
+
+    // Multiplier cycles: the ARM7's stops early once the rest of the
+    // multiplier is all zeros or all ones, the ARM9's takes one
+    uint32_t mulCycles(uint32_t rs) const {
+        if (model == ARM9) return 1;
+        for (uint32_t m = 1; m < 4; m++) {
+            int32_t top = (int32_t)rs >> (m * 8);
+            if (top == 0 || top == -1) return m;
+        }
+        return 4;
+    }
+
+    // Word load with the ARM9 rotation for unaligned addresses
+    uint32_t load32(uint32_t addr) {
+        uint32_t v = busRead<uint32_t>(addr & ~3);
+        uint32_t rot = (addr & 3) * 8;
+        return rot ? (v >> rot) | (v << (32 - rot)) : v;
     }
 
     // -------------------------------------------------
@@ -73,227 +385,839 @@ struct CPU {
     // -------------------------------------------------
     // STEP
     // -------------------------------------------------
-    void step() {
-        irq.step();
-        if (getFlag(T)) {
-            decodeThumb(fetch16());
+    // Time is the scheduler's clock, in ARM9 cycles for both cores. The
+    // core runs until the earliest pending event (sched.deadline) and
+    // then lets the scheduler fire whatever is due: timers, DMA, video,
+    // IRQ delivery.
+
+    // Runs one dispatch unit (an instruction, a cached block or a JIT
+    // slice), stopping early once the clock reaches 'stop' or an event
+    // falls due
+    void runSlice(uint64_t stop) {
+        if (useJIT) {
+            runJIT(stop);
+            return;
         }
-        else {
-            decodeARM(fetch32());
+        if (useBlockCache) {
+            runBlock(stop);
+            return;
         }
-        for (int i = 0; i < 4; i++)
-            mem->timers[i].step(&irq, i);
+
+        uint32_t instr = getFlag(T) ? fetch16() : fetch32();
+        uint32_t next = PC();
+        addCycles(1);
+        if (getFlag(T))
+            decodeThumb((uint16_t)instr);
+        else
+            decodeARM(instr);
+        if (PC() != next) addCycles(REFILL_CYCLES);
+    }
+
+    void step() {
+        Scheduler& sched = mem->scheduler;
+        if (!halted)
+            runSlice(sched.deadline);
+
+        // Nothing changes before the next event: skip straight to it
+        if ((halted || idleLoop) && sched.deadline != UINT64_MAX)
+            sched.now = std::max(sched.now, sched.deadline);
+        idleLoop = false;
+
+        if (sched.now >= sched.deadline)
+            sched.runDue();
+    }
+
+    // Runs for at least 'budget' cycles (a block may overshoot slightly);
+    // returns the number of cycles actually run
+    uint64_t runFor(uint64_t budget) {
+        Scheduler& sched = mem->scheduler;
+        uint64_t start = sched.now;
+        uint64_t target = start + budget;
+
+        while (sched.now < target) {
+            // 'deadline' may move earlier while a slice runs (IRQ, DMA)
+            while (sched.now < target && sched.now < sched.deadline) {
+                uint64_t stop = std::min(target, sched.deadline);
+                if (halted) {
+                    sched.now = stop;
+                    break;
+                }
+
+                runSlice(stop);
+
+                // An idle loop only spins until the next event
+                if (idleLoop) {
+                    idleLoop = false;
+                    sched.now = std::max(sched.now, std::min(target, sched.deadline));
+                }
+            }
+
+            sched.runDue();
+        }
+
+        return sched.now - start;
     }
 
     // =================================================
     // =================== THUMB =======================
     // =================================================
-    void decodeThumb(uint16_t instr) {
-        uint16_t op = instr >> 13;
+    // 1024 entries indexed by instruction bits 15-6, covering all 19
+    // Thumb formats. Built once at compile time like armTable.
+    using ThumbHandler = void (CPU::*)(uint16_t);
+    static const std::array<ThumbHandler, 1024> thumbTable;
 
-        switch (op) {
-        case 0b000: thumbShift(instr); break;
-        case 0b001: thumbImm(instr); break;
-        case 0b010: thumbALU(instr); break;
-        case 0b101: thumbBranch(instr); break;
-        default:
-            printf("UNIMPL THUMB %04X\n", instr);
-            break;
+    static constexpr ThumbHandler thumbHandlerFor(uint32_t index) {
+        uint32_t op5 = index >> 5;  // bits 15-11
+        uint32_t op4 = index >> 6;  // bits 15-12
+
+        if (op5 == 0b00011) return &CPU::thumbAddSub;         // 2
+        if (op4 <= 0b0001) return &CPU::thumbShift;           // 1
+        if (op4 <= 0b0011) return &CPU::thumbImm;             // 3
+        if ((index >> 4) == 0b010000) return &CPU::thumbALU;  // 4
+        if ((index >> 4) == 0b010001) return &CPU::thumbHiReg;// 5
+        if (op5 == 0b01001) return &CPU::thumbLoadPC;         // 6
+        if (op4 == 0b0101) {
+            if (index & 0x8) return &CPU::thumbLoadStoreSigned; // 8
+            return &CPU::thumbLoadStoreReg;                     // 7
+        }
+        if (op4 <= 0b0111) return &CPU::thumbLoadStoreImm;    // 9
+        if (op4 == 0b1000) return &CPU::thumbLoadStoreHalf;   // 10
+        if (op4 == 0b1001) return &CPU::thumbLoadStoreSP;     // 11
+        if (op4 == 0b1010) return &CPU::thumbLoadAddress;     // 12
+        if (op4 == 0b1011) {
+            if ((index >> 2) == 0b10110000) return &CPU::thumbAddSP; // 13
+            if ((index & 0x18) == 0x10) return &CPU::thumbPushPop;   // 14
+            return &CPU::thumbUnknown;
+        }
+        if (op4 == 0b1100) return &CPU::thumbLDMSTM;          // 15
+        if (op4 == 0b1101) {
+            uint32_t cond = (index >> 2) & 0xF;
+            if (cond == 0xF) return &CPU::thumbSWI;           // 17
+            if (cond == 0xE) return &CPU::thumbUnknown;
+            return &CPU::thumbCondBranch;                     // 16
         }
+        if (op5 == 0b11100) return &CPU::thumbBranch;         // 18
+        return &CPU::thumbLongBranch;                         // 19 (+ BLX suffix)
+    }
+
+    static constexpr std::array<ThumbHandler, 1024> buildThumbTable() {
+        std::array<ThumbHandler, 1024> t{};
+        for (uint32_t i = 0; i < 1024; i++)
+            t[i] = thumbHandlerFor(i);
+        return t;
+    }
+
+    void decodeThumb(uint16_t instr) {
+        (this->*thumbTable[instr >> 6])(instr);
     }
 
+    // PC as seen by a Thumb instruction (instruction address + 4)
+    inline uint32_t thumbPC() { return PC() + 2; }
+
+    void thumbUnknown(uint16_t instr) {
+        printf("UNIMPL THUMB %04X\n", instr);
+    }
+
+    // 1: LSL/LSR/ASR Rd, Rs, #imm
     void thumbShift(uint16_t instr) {
         uint32_t type = (instr >> 11) & 3;
         uint32_t imm = (instr >> 6) & 0x1F;
         uint32_t Rs = (instr >> 3) & 7;
         uint32_t Rd = instr & 7;
 
-        uint32_t v = R[Rs];
-        uint32_t r = 0;
-
-        if (type == 0) r = v << imm;
-        else if (type == 1) r = v >> imm;
-        else r = ((int32_t)v) >> imm;
+        bool c = getFlag(C);
+        uint32_t r = shiftImm(type, R[Rs], imm, c);
 
         R[Rd] = r;
         setNZ(r);
+        setFlag(C, c);
+    }
+
+    // 2: ADD/SUB Rd, Rs, Rn / #imm3
+    void thumbAddSub(uint16_t instr) {
+        bool I = instr & (1 << 10);
+        bool sub = instr & (1 << 9);
+        uint32_t Rn = (instr >> 6) & 7;
+        uint32_t Rs = (instr >> 3) & 7;
+        uint32_t Rd = instr & 7;
+
+        uint32_t b = I ? Rn : R[Rn];
+        R[Rd] = sub ? subWithFlags(R[Rs], b) : addWithFlags(R[Rs], b);
     }
 
+    // 3: MOV/CMP/ADD/SUB Rd, #imm8
     void thumbImm(uint16_t instr) {
         uint32_t op = (instr >> 11) & 3;
         uint32_t Rd = (instr >> 8) & 7;
         uint32_t imm = instr & 0xFF;
 
-        uint32_t r;
-        if (op == 0) R[Rd] = imm;
-        else if (op == 1) { r = R[Rd] - imm; setNZ(r); setFlag(C, R[Rd] >= imm); return; }
-        else if (op == 2) R[Rd] += imm;
-        else R[Rd] -= imm;
-
-        setNZ(R[Rd]);
+        switch (op) {
+        case 0: R[Rd] = imm; setNZ(imm); break;
+        case 1: subWithFlags(R[Rd], imm); break;
+        case 2: R[Rd] = addWithFlags(R[Rd], imm); break;
+        case 3: R[Rd] = subWithFlags(R[Rd], imm); break;
+        }
     }
 
+    // 4: ALU operations
     void thumbALU(uint16_t instr) {
         uint32_t op = (instr >> 6) & 0xF;
         uint32_t Rs = (instr >> 3) & 7;
         uint32_t Rd = instr & 7;
 
         uint32_t a = R[Rd], b = R[Rs], r = 0;
+        bool c = getFlag(C);
 
         switch (op) {
-        case 0x0: r = a & b; break;
-        case 0x1: r = a ^ b; break;
-        case 0xC: r = a | b; break;
-        case 0xD: r = b; break;
-        default:
-            printf("UNIMPL THUMB ALU %X\n", op);
-            return;
+        case 0x0: r = a & b; break;                                     // AND
+        case 0x1: r = a ^ b; break;                                     // EOR
+        case 0x2: r = shiftReg(LSL, a, b & 0xFF, c); setFlag(C, c); addCycles(1); break;
+        case 0x3: r = shiftReg(LSR, a, b & 0xFF, c); setFlag(C, c); addCycles(1); break;
+        case 0x4: r = shiftReg(ASR, a, b & 0xFF, c); setFlag(C, c); addCycles(1); break;
+        case 0x5: R[Rd] = addWithFlags(a, b, c); return;                // ADC
+        case 0x6: R[Rd] = subWithFlags(a, b, c); return;                // SBC
+        case 0x7: r = shiftReg(ROR, a, b & 0xFF, c); setFlag(C, c); addCycles(1); break;
+        case 0x8: setNZ(a & b); return;                                 // TST
+        case 0x9: R[Rd] = subWithFlags(0, b); return;                   // NEG
+        case 0xA: subWithFlags(a, b); return;                           // CMP
+        case 0xB: addWithFlags(a, b); return;                           // CMN
+        case 0xC: r = a | b; break;                                     // ORR
+        case 0xD: r = a * b; addCycles(mulCycles(a)); break;            // MUL
+        case 0xE: r = a & ~b; break;                                    // BIC
+        case 0xF: r = ~b; break;                                        // MVN
         }
 
         R[Rd] = r;
         setNZ(r);
     }
 
+    // 5: ADD/CMP/MOV on hi registers, BX/BLX
+    void thumbHiReg(uint16_t instr) {
+        uint32_t op = (instr >> 8) & 3;
+        uint32_t Rs = ((instr >> 3) & 7) | ((instr >> 3) & 8);
+        uint32_t Rd = (instr & 7) | ((instr >> 4) & 8);
+
+        uint32_t v = Rs == 15 ? thumbPC() : R[Rs];
+
+        switch (op) {
+        case 0: {
+            uint32_t r = (Rd == 15 ? thumbPC() : R[Rd]) + v;
+            if (Rd == 15) PC() = r & ~1;
+            else R[Rd] = r;
+            break;
+        }
+        case 1:
+            subWithFlags(Rd == 15 ? thumbPC() : R[Rd], v);
+            break;
+        case 2:
+            if (Rd == 15) PC() = v & ~1;
+            else R[Rd] = v;
+            break;
+        case 3:
+            if ((instr & (1 << 7)) && model == ARM9) R[14] = PC() | 1; // BLX
+            setFlag(T, v & 1);
+            PC() = v & ((v & 1) ? ~1u : ~3u);
+            break;
+        }
+    }
+
+    // 6: LDR Rd, [PC, #imm]
+    void thumbLoadPC(uint16_t instr) {
+        uint32_t Rd = (instr >> 8) & 7;
+        R[Rd] = busRead<uint32_t>((thumbPC() & ~3) + ((instr & 0xFF) << 2));
+        addCycles(1);
+    }
+
+    // 7: STR/STRB/LDR/LDRB Rd, [Rb, Ro]
+    void thumbLoadStoreReg(uint16_t instr) {
+        bool L = instr & (1 << 11);
+        bool B = instr & (1 << 10);
+        uint32_t addr = R[(instr >> 3) & 7] + R[(instr >> 6) & 7];
+        uint32_t Rd = instr & 7;
+
+        if (L) {
+            R[Rd] = B ? busRead<uint8_t>(addr) : load32(addr);
+            addCycles(1);
+        }
+        else if (B) busWrite<uint8_t>(addr, (uint8_t)R[Rd]);
+        else busWrite<uint32_t>(addr & ~3, R[Rd]);
+    }
+
+    // 8: STRH/LDSB/LDRH/LDSH Rd, [Rb, Ro]
+    void thumbLoadStoreSigned(uint16_t instr) {
+        uint32_t op = (instr >> 10) & 3;
+        uint32_t addr = R[(instr >> 3) & 7] + R[(instr >> 6) & 7];
+        uint32_t Rd = instr & 7;
+
+        switch (op) {
+        case 0: busWrite<uint16_t>(addr & ~1, (uint16_t)R[Rd]); return;
+        case 1: R[Rd] = (int8_t)busRead<uint8_t>(addr); break;
+        case 2: R[Rd] = busRead<uint16_t>(addr & ~1); break;
+        case 3: R[Rd] = (int16_t)busRead<uint16_t>(addr & ~1); break;
+        }
+        addCycles(1);
+    }
+
+    // 9: STR/LDR/STRB/LDRB Rd, [Rb, #imm]
+    void thumbLoadStoreImm(uint16_t instr) {
+        bool B = instr & (1 << 12);
+        bool L = instr & (1 << 11);
+        uint32_t off = (instr >> 6) & 0x1F;
+        uint32_t Rd = instr & 7;
+        uint32_t addr = R[(instr >> 3) & 7] + (B ? off : off << 2);
+
+        if (L) {
+            R[Rd] = B ? busRead<uint8_t>(addr) : load32(addr);
+            addCycles(1);
+        }
+        else if (B) busWrite<uint8_t>(addr, (uint8_t)R[Rd]);
+        else busWrite<uint32_t>(addr & ~3, R[Rd]);
+    }
+
+    // 10: STRH/LDRH Rd, [Rb, #imm]
+    void thumbLoadStoreHalf(uint16_t instr) {
+        bool L = instr & (1 << 11);
+        uint32_t Rd = instr & 7;
+        uint32_t addr = R[(instr >> 3) & 7] + (((instr >> 6) & 0x1F) << 1);
+
+        if (L) {
+            R[Rd] = busRead<uint16_t>(addr & ~1);
+            addCycles(1);
+        }
+        else busWrite<uint16_t>(addr & ~1, (uint16_t)R[Rd]);
+    }
+
+    // 11: STR/LDR Rd, [SP, #imm]
+    void thumbLoadStoreSP(uint16_t instr) {
+        bool L = instr & (1 << 11);
+        uint32_t Rd = (instr >> 8) & 7;
+        uint32_t addr = R[13] + ((instr & 0xFF) << 2);
+
+        if (L) {
+            R[Rd] = load32(addr);
+            addCycles(1);
+        }
+        else busWrite<uint32_t>(addr & ~3, R[Rd]);
+    }
+
+    // 12: ADD Rd, PC/SP, #imm
+    void thumbLoadAddress(uint16_t instr) {
+        bool SP = instr & (1 << 11);
+        uint32_t Rd = (instr >> 8) & 7;
+        uint32_t base = SP ? R[13] : (thumbPC() & ~3);
+        R[Rd] = base + ((instr & 0xFF) << 2);
+    }
+
+    // 13: ADD SP, #+/-imm
+    void thumbAddSP(uint16_t instr) {
+        uint32_t off = (instr & 0x7F) << 2;
+        if (instr & (1 << 7)) R[13] -= off;
+        else R[13] += off;
+    }
+
+    // 14: PUSH {rlist, LR} / POP {rlist, PC}
+    void thumbPushPop(uint16_t instr) {
+        bool L = instr & (1 << 11);
+        bool extra = instr & (1 << 8);
+        uint32_t list = instr & 0xFF;
+
+        // LR/PC ride along as the top register of the list
+        uint32_t regs = list | (extra ? (L ? 1u << 15 : 1u << 14) : 0);
+        uint32_t size = popcount(regs) * 4;
+
+        if (L) {
+            transferRegs(R[13], regs, true);
+            R[13] += size;
+            if (extra) {
+                uint32_t v = R[15];
+                if (model == ARM9) setFlag(T, v & 1);
+                PC() = v & (getFlag(T) ? ~1u : ~3u);
+            }
+        }
+        else {
+            R[13] -= size;
+            transferRegs(R[13], regs, false);
+        }
+    }
+
+    // 15: LDMIA/STMIA Rb!, {rlist}
+    void thumbLDMSTM(uint16_t instr) {
+        bool L = instr & (1 << 11);
+        uint32_t Rb = (instr >> 8) & 7;
+        uint32_t list = instr & 0xFF;
+        uint32_t addr = R[Rb];
+
+        if (!list) {
+            R[Rb] += 0x40;
+            return;
+        }
+
+        transferRegs(addr, list, L);
+        addr += popcount(list) * 4;
+
+        if (!L || !(list & (1 << Rb))) R[Rb] = addr;
+    }
+
+    // 16: B<cond> label
+    void thumbCondBranch(uint16_t instr) {
+        if (!checkCond((instr >> 8) & 0xF)) return;
+        int32_t off = (int8_t)(instr & 0xFF);
+        PC() = thumbPC() + (off << 1);
+    }
+
+    // 17: SWI #imm8
+    void thumbSWI(uint16_t instr) {
+        if (!bios.call(instr & 0xFF))
+            printf("SWI %02X\n", instr & 0xFF);
+    }
+
+    // 18: B label
     void thumbBranch(uint16_t instr) {
         int32_t off = instr & 0x7FF;
         if (off & 0x400) off |= 0xFFFFF800;
-        PC() += off << 1;
+        PC() = thumbPC() + (off << 1);
+    }
+
+    // 19: BL/BLX label (two halves)
+    void thumbLongBranch(uint16_t instr) {
+        uint32_t off = instr & 0x7FF;
+        uint32_t op = (instr >> 11) & 3;
+
+        if (op == 0b10) {
+            int32_t hi = off;
+            if (hi & 0x400) hi |= 0xFFFFF800;
+            R[14] = thumbPC() + (hi << 12);
+            return;
+        }
+
+        uint32_t next = PC();
+        uint32_t target = R[14] + (off << 1);
+        R[14] = next | 1;
+
+        if (op == 0b01) { // BLX: switch to ARM
+            if (model == ARM7) {
+                thumbUnknown(instr);
+                return;
+            }
+            setFlag(T, false);
+            target &= ~3;
+        }
+        PC() = target;
     }
 
     // =================================================
     // =================== ARM =========================
     // =================================================
-    bool checkCond(uint32_t cond) {
-        switch (cond) {
-        case 0x0: return getFlag(Z);
-        case 0x1: return !getFlag(Z);
-        case 0xE: return true;
-        default: return true;
+    // condTable[cond] has bit n set when cond passes for NZCV == n
+    static constexpr std::array<uint16_t, 16> buildCondTable() {
+        std::array<uint16_t, 16> t{};
+        for (uint32_t f = 0; f < 16; f++) {
+            bool n = f & 8, z = f & 4, c = f & 2, v = f & 1;
+            bool pass[16] = {
+                z, !z, c, !c, n, !n, v, !v,         // EQ NE CS CC MI PL VS VC
+                c && !z, !c || z, n == v, n != v,   // HI LS GE LT
+                !z && n == v, z || n != v,          // GT LE
+                true, true                          // AL, NV (treated as AL)
+            };
+            for (uint32_t cond = 0; cond < 16; cond++)
+                if (pass[cond]) t[cond] |= 1 << f;
         }
+        return t;
     }
 
-    void decodeARM(uint32_t instr) {
+    static const std::array<uint16_t, 16> condTable;
 
-        if (!checkCond(instr >> 28)) return;
+    bool checkCond(uint32_t cond) {
+        if (cond == 0xE) return true;
+        return (condTable[cond] >> (readCPSR() >> 28)) & 1;
+    }
+
+    // -------------------------------------------------
+    // ARM DISPATCH
+    // -------------------------------------------------
+    // 4096 entries indexed by instruction bits 27-20 and 7-4.
+    // Built once at compile time so decodeARM jumps straight to a handler.
+    // armTable uses the template-specialized DP handlers, armTableGeneric
+    // keeps the runtime-decoded execDP for comparison.
+    using ARMHandler = void (CPU::*)(uint32_t);
+    static const std::array<ARMHandler, 4096> armTable;
+    static const std::array<ARMHandler, 4096> armTableGeneric;
+
+    const ARMHandler* armDispatch = armTable.data();
+
+    void setSpecializedDP(bool enabled) {
+        armDispatch = enabled ? armTable.data() : armTableGeneric.data();
+        blocks.invalidateAll();
+    }
+
+    static constexpr uint32_t armIndex(uint32_t instr) {
+        return ((instr >> 16) & 0xFF0) | ((instr >> 4) & 0xF);
+    }
+
+    static constexpr ARMHandler armHandlerFor(uint32_t index, const std::array<ARMHandler, 512>* dp) {
+        uint32_t hi = index >> 4;   // bits 27-20
+        uint32_t lo = index & 0xF;  // bits 7-4
 
         // SWI
-        if ((instr & 0x0F000000) == 0x0F000000) {
-            execSWI(instr);
-            return;
-        }
+        if ((hi & 0xF0) == 0xF0) return &CPU::execSWI;
 
-        // BX / BLX
-        if ((instr & 0x0FFFFFF0) == 0x012FFF10 ||
-            (instr & 0x0FFFFFF0) == 0x012FFF30) {
-            execBX(instr);
-            return;
-        }
+        // MCR / MRC
+        if ((hi & 0xF0) == 0xE0 && (lo & 1)) return &CPU::execCoproc;
+
+        // BX / BLX (bits 19-8 are checked by the handler)
+        if (hi == 0x12 && (lo == 0x1 || lo == 0x3)) return &CPU::armBX;
 
         // LDM / STM
-        if ((instr & 0x0E000000) == 0x08000000) {
-            execLDMSTM(instr);
-            return;
-        }
+        if ((hi & 0xE0) == 0x80) return &CPU::execLDMSTM;
 
         // Branch
-        if ((instr & 0x0E000000) == 0x0A000000) {
-            execBranch(instr);
-            return;
-        }
+        if ((hi & 0xE0) == 0xA0) return &CPU::execBranch;
 
         // Data processing
-        if ((instr & 0x0C000000) == 0x00000000 ||
-            (instr & 0x0C000000) == 0x02000000) {
-            execDP(instr);
-            return;
+        if ((hi & 0xC0) == 0x00) {
+            bool I = hi & 0x20;
+            bool S = hi & 0x01;
+            uint32_t op = (hi >> 1) & 0xF;
+
+            // Multiply / halfword transfer space
+            if (!I && (lo & 0x9) == 0x9) return &CPU::armUnknown;
+
+            // TST/TEQ/CMP/CMN without S: MRS / MSR
+            if (!S && (op & 0xC) == 0x8) {
+                if (!I && lo == 0 && !(op & 1)) return &CPU::execPSR; // MRS
+                if (op & 1 && (I || lo == 0)) return &CPU::execPSR;    // MSR
+                return &CPU::armUnknown;
+            }
+
+            if (!dp) return &CPU::execDP;
+            return (*dp)[dpKey(op, S, I, (lo >> 1) & 3, lo & 1)];
         }
 
         // Load / Store
-        if ((instr & 0x0C000000) == 0x04000000) {
-            execLoadStore(instr);
-            return;
-        }
+        if ((hi & 0xC0) == 0x40) return &CPU::execLoadStore;
+
+        return &CPU::armUnknown;
+    }
+
+    static constexpr std::array<ARMHandler, 4096> buildARMTable(bool specialized) {
+        const auto dp = makeDPTable(std::make_index_sequence<512>{});
+        std::array<ARMHandler, 4096> t{};
+        for (uint32_t i = 0; i < 4096; i++)
+            t[i] = armHandlerFor(i, specialized ? &dp : nullptr);
+        return t;
+    }
 
+    // PC as seen by an ARM instruction (instruction address + 8)
+    inline uint32_t armPC() { return PC() + 4; }
+
+    // Register operand of an ARM instruction. A register-specified shift
+    // takes an extra cycle, so R15 reads one word further on there.
+    inline uint32_t armReg(uint32_t r, bool regShift = false) {
+        return r == 15 ? armPC() + (regShift ? 4 : 0) : R[r];
+    }
+
+    void decodeARM(uint32_t instr) {
+        if (!checkCond(instr >> 28)) return;
+        (this->*armDispatch[armIndex(instr)])(instr);
+    }
+
+    void armBX(uint32_t instr) {
+        // Bits 19-8 are not part of the index; BLX Rm is ARMv5
+        bool blx = instr & (1 << 5);
+        if ((instr & 0x000FFF00) == 0x000FFF00 && !(blx && model == ARM7)) execBX(instr);
+        else armUnknown(instr);
+    }
+
+    void armUnknown(uint32_t instr) {
         printf("UNKNOWN ARM %08X\n", instr);
     }
 
     // -------------------------------------------------
-    // ARM HELPERS
+    // DATA PROCESSING
     // -------------------------------------------------
-    uint32_t operand2(uint32_t instr) {
+    // dpApply is templated on opcode and S so each instantiation only
+    // carries the ALU and flag work that variant needs.
+    template <uint32_t OP, bool S>
+    void dpApply(uint32_t Rd, uint32_t a, uint32_t b, bool carry) {
+        constexpr bool test = OP >= 0x8 && OP <= 0xB;
+        constexpr bool logical = OP == 0x0 || OP == 0x1 || OP == 0x8 || OP == 0x9 || OP >= 0xC;
+
+        if constexpr (test && !S) return;
+
+        uint32_t r;
+        if constexpr (OP == 0x0 || OP == 0x8) r = a & b;               // AND / TST
+        else if constexpr (OP == 0x1 || OP == 0x9) r = a ^ b;          // EOR / TEQ
+        else if constexpr (OP == 0xC) r = a | b;                       // ORR
+        else if constexpr (OP == 0xD) r = b;                           // MOV
+        else if constexpr (OP == 0xE) r = a & ~b;                      // BIC
+        else if constexpr (OP == 0xF) r = ~b;                          // MVN
+        else if constexpr (OP == 0x2 || OP == 0xA)                     // SUB / CMP
+            r = S ? subWithFlags(a, b) : a - b;
+        else if constexpr (OP == 0x3)                                  // RSB
+            r = S ? subWithFlags(b, a) : b - a;
+        else if constexpr (OP == 0x4 || OP == 0xB)                     // ADD / CMN
+            r = S ? addWithFlags(a, b) : a + b;
+        else if constexpr (OP == 0x5)                                  // ADC
+            r = S ? addWithFlags(a, b, getFlag(C)) : a + b + getFlag(C);
+        else if constexpr (OP == 0x6)                                  // SBC
+            r = S ? subWithFlags(a, b, getFlag(C)) : a - b - !getFlag(C);
+        else                                                           // RSC
+            r = S ? subWithFlags(b, a, getFlag(C)) : b - a - !getFlag(C);
+
+        if constexpr (S && logical) {
+            setNZ(r);
+            setFlag(C, carry);
+        }
+        if constexpr (!test) {
+            R[Rd] = r;
+            if constexpr (S) if (Rd == 15) restoreCPSR();
+        }
+    }
+
+    template <uint32_t OP, bool S, bool I, uint32_t SHIFT, bool RS>
+    void armDP(uint32_t instr) {
+        bool carry = getFlag(C);
+        uint32_t b;
+
+        if constexpr (I) {
+            uint32_t rot = ((instr >> 8) & 0xF) * 2;
+            b = std::rotr(instr & 0xFF, rot);
+            if (rot) carry = b >> 31;
+        }
+        else if constexpr (RS) {
+            b = shiftReg(SHIFT, armReg(instr & 0xF, true), R[(instr >> 8) & 0xF] & 0xFF, carry);
+            addCycles(1);
+        }
+        else {
+            b = shiftImm(SHIFT, armReg(instr & 0xF), (instr >> 7) & 0x1F, carry);
+        }
+
+        dpApply<OP, S>((instr >> 12) & 0xF, armReg((instr >> 16) & 0xF, RS), b, carry);
+    }
+
+    // 512 keys: opcode, S, I, shift type, register-shift. Immediate forms
+    // ignore the shift bits and share one instantiation.
+    static constexpr uint32_t dpKey(uint32_t op, bool s, bool i, uint32_t shift, bool rs) {
+        return (op << 5) | (s << 4) | (i << 3) | (shift << 1) | rs;
+    }
+
+    template <uint32_t KEY>
+    static constexpr ARMHandler dpHandler() {
+        constexpr uint32_t op = KEY >> 5;
+        constexpr bool s = KEY & 0x10;
+        if constexpr (KEY & 0x8) return &CPU::armDP<op, s, true, 0, false>;
+        else return &CPU::armDP<op, s, false, (KEY >> 1) & 3, (KEY & 1) != 0>;
+    }
+
+    template <size_t... KEYS>
+    static constexpr std::array<ARMHandler, 512> makeDPTable(std::index_sequence<KEYS...>) {
+        return { dpHandler<KEYS>()... };
+    }
+
+    template <size_t... KEYS>
+    static constexpr std::array<void (CPU::*)(uint32_t, uint32_t, uint32_t, bool), 32>
+    makeDPApplyTable(std::index_sequence<KEYS...>) {
+        return { &CPU::dpApply<(KEYS >> 1), (KEYS & 1) != 0>... };
+    }
+
+    uint32_t operand2(uint32_t instr, bool& carry) {
         if (instr & (1 << 25)) {
-            uint32_t imm = instr & 0xFF;
             uint32_t rot = ((instr >> 8) & 0xF) * 2;
-            return (imm >> rot) | (imm << (32 - rot));
+            uint32_t imm = std::rotr(instr & 0xFF, rot);
+            if (rot) carry = imm >> 31;
+            return imm;
         }
-        return R[instr & 0xF];
+
+        uint32_t type = (instr >> 5) & 3;
+        if (instr & (1 << 4)) {
+            addCycles(1);
+            return shiftReg(type, armReg(instr & 0xF, true), R[(instr >> 8) & 0xF] & 0xFF, carry);
+        }
+        return shiftImm(type, armReg(instr & 0xF), (instr >> 7) & 0x1F, carry);
     }
 
+    // Generic path: opcode, S and operand2 decoded on every call
     void execDP(uint32_t instr) {
+        static constexpr auto ops = makeDPApplyTable(std::make_index_sequence<32>{});
+
         uint32_t op = (instr >> 21) & 0xF;
         bool s = instr & (1 << 20);
         uint32_t Rn = (instr >> 16) & 0xF;
         uint32_t Rd = (instr >> 12) & 0xF;
-        uint32_t op2 = operand2(instr);
 
-        uint32_t r = 0;
+        bool carry = getFlag(C);
+        uint32_t op2 = operand2(instr, carry);
 
-        switch (op) {
-        case 0x0: r = R[Rn] & op2; break;
-        case 0x1: r = R[Rn] ^ op2; break;
-        case 0x2: r = R[Rn] - op2; break;
-        case 0x4: r = R[Rn] + op2; break;
-        case 0xA: r = R[Rn] - op2; setNZ(r); return;
-        case 0xC: r = R[Rn] | op2; break;
-        case 0xD: r = op2; break;
-        default:
-            printf("UNIMPL DP %X\n", op);
+        bool regShift = !(instr & (1 << 25)) && (instr & (1 << 4));
+        (this->*ops[(op << 1) | s])(Rd, armReg(Rn, regShift), op2, carry);
+    }
+
+    // MRS / MSR
+    void execPSR(uint32_t instr) {
+        bool spsr = instr & (1 << 22);
+
+        if (!(instr & (1 << 21))) {
+            R[(instr >> 12) & 0xF] = spsr ? SPSR() : readCPSR();
             return;
         }
 
-        R[Rd] = r;
-        if (s) setNZ(r);
+        resolveFlags();
+
+        uint32_t v = (instr & (1 << 25))
+            ? std::rotr(instr & 0xFF, ((instr >> 8) & 0xF) * 2)
+            : R[instr & 0xF];
+
+        uint32_t mask = 0;
+        for (int i = 0; i < 4; i++)
+            if (instr & (1 << (16 + i))) mask |= 0xFFu << (i * 8);
+
+        if (spsr) {
+            if (hasSPSR()) SPSR() = (SPSR() & ~mask) | (v & mask);
+            return;
+        }
+
+        // User mode may only touch the flags; T is never written by MSR
+        if (mode() == MODE_USR) mask &= 0xFF000000;
+        mask &= ~(uint32_t)T;
+
+        uint32_t old = CPSR;
+        uint32_t nv = (CPSR & ~mask) | (v & mask);
+        if ((old ^ nv) & 0x1F) switchMode(nv);
+        CPSR = nv;
+        if ((old ^ nv) & I) irq.update();
     }
 
+    // -------------------------------------------------
+    // ARM HELPERS
+    // -------------------------------------------------
     void execBranch(uint32_t instr) {
         int32_t off = instr & 0x00FFFFFF;
         if (off & 0x00800000) off |= 0xFF000000;
-        PC() += off << 2;
+
+        // NV space: BLX imm on ARMv5, with bit 24 (H) as a halfword
+        // offset. ARMv4 never executes NV instructions.
+        if ((instr >> 28) == 0xF) {
+            if (model == ARM7) return;
+            R[14] = PC();
+            setFlag(T, true);
+            PC() = armPC() + (off << 2) + ((instr >> 23) & 2);
+            return;
+        }
+
+        if (instr & (1 << 24)) R[14] = PC(); // BL
+        PC() = armPC() + (off << 2);
     }
 
     void execBX(uint32_t instr) {
         uint32_t rm = instr & 0xF;
-        uint32_t target = R[rm];
+        uint32_t target = armReg(rm);
         setFlag(T, target & 1);
         PC() = target & ~1;
     }
 
+    // Moves the registers in 'list' to or from consecutive words at
+    // 'addr'. A run that is plain memory within one page is copied
+    // straight between the register file and host memory.
+    void transferRegs(uint32_t addr, uint32_t list, bool load) {
+        addr &= ~3u;
+        if (load) addCycles(1);
+
+        uint32_t count = popcount(list);
+        if (uint8_t* p = mem->hostSpan(addr, count * 4, !load)) {
+            // One page, so every word waits the same
+            mem->scheduler.now += count * mem->accessCycles<uint32_t>(addr);
+            for (uint32_t l = list; l; l &= l - 1) {
+                int i = std::countr_zero(l);
+                if (load) memcpy(&R[i], p, 4);
+                else memcpy(p, &R[i], 4);
+                p += 4;
+            }
+            return;
+        }
+
+        for (uint32_t l = list; l; l &= l - 1) {
+            int i = std::countr_zero(l);
+            if (load) R[i] = busRead<uint32_t>(addr);
+            else busWrite<uint32_t>(addr, R[i]);
+            addr += 4;
+        }
+    }
+
+    // User-mode view of R8-R14, for LDM/STM with the S bit
+    uint32_t& userReg(int i) {
+        int bank = bankOf(CPSR);
+        if (i >= 8 && i <= 12 && bank == 1) return bankFIQ[i - 8];
+        if (i == 13 && bank != 0) return bankR13[0];
+        if (i == 14 && bank != 0) return bankR14[0];
+        return R[i];
+    }
+
     void execLDMSTM(uint32_t instr) {
         bool P = instr & (1 << 24);
         bool U = instr & (1 << 23);
+        bool S = instr & (1 << 22);
         bool W = instr & (1 << 21);
         bool L = instr & (1 << 20);
 
         uint32_t rn = (instr >> 16) & 0xF;
         uint32_t list = instr & 0xFFFF;
-
         uint32_t base = R[rn];
+
+        // Empty list: nothing moves, the base still steps by 0x40
+        if (!list) {
+            if (W) R[rn] = U ? base + 0x40 : base - 0x40;
+            return;
+        }
+
         int count = popcount(list);
-            (list);
+        bool loadPC = L && (list & (1 << 15));
 
         uint32_t addr = base;
         if (U) addr += P ? 4 : 0;
         else addr -= P ? count * 4 : (count - 1) * 4;
 
-        for (int i = 0; i < 16; i++) {
-            if (list & (1 << i)) {
-                if (L) R[i] = mem->read32(addr);
-                else mem->write32(addr, R[i]);
+        uint32_t newBase = U ? base + count * 4 : base - count * 4;
+
+        // R15 goes out as the instruction address + 12, as with STR
+        uint32_t next = PC();
+        bool storePC = !L && (list & (1 << 15));
+        if (storePC) PC() = armPC() + 4;
+
+        // ARMv4: STM stores the updated base unless it is the first
+        // register in the list
+        if (model == ARM7 && !L && W && (list & (1 << rn)) && (list & ((1u << rn) - 1)))
+            R[rn] = newBase;
+
+        if (S && !loadPC) {
+            // STM^ / LDM^ without PC: user bank registers
+            addr &= ~3u;
+            if (L) addCycles(1);
+            for (uint32_t l = list; l; l &= l - 1) {
+                uint32_t& r = userReg(std::countr_zero(l));
+                if (L) r = busRead<uint32_t>(addr);
+                else busWrite<uint32_t>(addr, r);
                 addr += 4;
             }
         }
+        else {
+            transferRegs(addr, list, L);
+        }
+        if (storePC) PC() = next;
 
-        if (W) R[rn] = U ? base + count * 4 : base - count * 4;
+        // ARMv5: STM stores the old base; LDM keeps the loaded base
+        // only when it is the last of several registers. ARMv4 LDM
+        // always keeps the loaded base.
+        bool baseLoaded = L && (list & (1 << rn)) &&
+                          (model == ARM7 || ((list >> rn) == 1 && count > 1));
+        if (W && !baseLoaded) R[rn] = newBase;
+
+        if (loadPC) {
+            uint32_t v = R[15];
+            if (S) restoreCPSR();           // exception return: SPSR picks the state
+            else if (model == ARM9)
+                setFlag(T, v & 1);          // ARMv5 interworking
+            PC() = v & (getFlag(T) ? ~1u : ~3u);
+        }
     }
 
     void execLoadStore(uint32_t instr) {
@@ -307,17 +1231,456 @@ struct CPU {
         uint32_t Rd = (instr >> 12) & 0xF;
         uint32_t off = instr & 0xFFF;
 
-        uint32_t base = R[Rn];
+        uint32_t base = armReg(Rn);
         uint32_t addr = P ? (U ? base + off : base - off) : base;
 
-        if (L) R[Rd] = B ? mem->read8(addr) : mem->read32(addr);
-        else B ? mem->write8(addr, R[Rd]) : mem->write32(addr, R[Rd]);
+        // A stored PC is the instruction address + 12
+        if (L) {
+            R[Rd] = B ? busRead<uint8_t>(addr) : busRead<uint32_t>(addr);
+            addCycles(1);
+        }
+        else {
+            uint32_t v = Rd == 15 ? armPC() + 4 : R[Rd];
+            if (B) busWrite<uint8_t>(addr, (uint8_t)v);
+            else busWrite<uint32_t>(addr, v);
+        }
 
+        // post-indexed transfers always write back
         if (!P) addr = U ? base + off : base - off;
-        if (W) R[Rn] = addr;
+        if (W || !P) R[Rn] = addr;
+
+        // LDR PC interworks on ARMv5, as LDM does
+        if (L && Rd == 15) {
+            if (model == ARM9) setFlag(T, PC() & 1);
+            PC() &= getFlag(T) ? ~1u : ~3u;
+        }
     }
 
+    // The BIOS takes the call number from bits 23-16 in ARM state
     void execSWI(uint32_t instr) {
-        printf("SWI %06X\n", instr & 0xFFFFFF);
+        if (!bios.call((instr >> 16) & 0xFF))
+            printf("SWI %06X\n", instr & 0xFFFFFF);
+    }
+
+    // -------------------------------------------------
+    // COPROCESSOR
+    // -------------------------------------------------
+    // Only CP15 exists, and only on the ARM9. An MCR can remap the TCMs,
+    // so it ends the block it is in.
+    void execCoproc(uint32_t instr) {
+        uint32_t cp = (instr >> 8) & 0xF;
+        if (cp != 15 || model == ARM7) {
+            armUnknown(instr);
+            return;
+        }
+
+        uint32_t cn = (instr >> 16) & 0xF;
+        uint32_t cm = instr & 0xF;
+        uint32_t op2 = (instr >> 5) & 7;
+        uint32_t Rd = (instr >> 12) & 0xF;
+
+        if (instr & (1 << 20)) {
+            uint32_t v = cp15.read(cn, cm, op2);
+            if (Rd == 15) {
+                resolveFlags();
+                CPSR = (CPSR & 0x0FFFFFFF) | (v & 0xF0000000);
+            }
+            else R[Rd] = v;
+        }
+        else {
+            cp15.write(cn, cm, op2, Rd == 15 ? armPC() : R[Rd]);
+        }
+    }
+
+    // -------------------------------------------------
+    // BLOCK CACHE
+    // -------------------------------------------------
+    // Runs of instructions are decoded once into {handler, instr} records
+    // keyed by PC and replayed without fetching through Memory.
+    union CachedHandler {
+        ARMHandler arm;
+        ThumbHandler thumb;
+    };
+
+    struct CachedOp {
+        CachedHandler handler;
+        uint32_t instr;
+    };
+
+    using Block = BlockCache<CachedOp>::Block;
+    static constexpr int MAX_BLOCK_OPS = 32;
+
+    BlockCache<CachedOp> blocks;
+    bool useBlockCache = false;
+
+    // Set by runBlock when an idle loop just went around once
+    bool idleLoop = false;
+
+    static bool endsBlockARM(uint32_t instr, ARMHandler h) {
+        if (h == &CPU::execBranch || h == &CPU::armBX || h == &CPU::execSWI ||
+            h == &CPU::execPSR || h == &CPU::execCoproc || h == &CPU::armUnknown)
+            return true;
+        if (h == &CPU::execLDMSTM)
+            return (instr & (1 << 20)) && (instr & (1 << 15));
+        // Base writeback into R15 redirects execution as well
+        if (h == &CPU::execLoadStore && ((instr >> 16) & 0xF) == 15 &&
+            ((instr & (1 << 21)) || !(instr & (1 << 24))))
+            return true;
+        return ((instr >> 12) & 0xF) == 15;
+    }
+
+    static bool endsBlockThumb(uint16_t instr, ThumbHandler h) {
+        if (h == &CPU::thumbBranch || h == &CPU::thumbCondBranch || h == &CPU::thumbLongBranch ||
+            h == &CPU::thumbSWI || h == &CPU::thumbUnknown)
+            return true;
+        if (h == &CPU::thumbHiReg)
+            return ((instr >> 8) & 3) == 3 || (instr & 0x87) == 0x87;
+        if (h == &CPU::thumbPushPop)
+            return (instr & (1 << 11)) && (instr & (1 << 8));
+        return false;
+    }
+
+    Block* compileBlock(uint32_t key) {
+        auto b = std::make_unique<Block>();
+        bool thumb = key & 1;
+        uint32_t addr = key & ~1u;
+
+        b->key = key;
+        b->start = addr;
+        b->phys = mem->physical(addr);
+
+        for (int i = 0; i < MAX_BLOCK_OPS; i++) {
+            CachedOp op;
+            bool last;
+
+            // Blocks cover one physical run, so they end where a mirror
+            // or a different memory starts
+            if (i && !(addr & Memory::PAGE_MASK) && mem->physical(addr) != b->phys + (addr - b->start))
+                break;
+
+            if (thumb) {
+                uint16_t instr = mem->read16(addr);
+                op.handler.thumb = thumbTable[instr >> 6];
+                op.instr = instr;
+                last = endsBlockThumb(instr, op.handler.thumb);
+                addr += 2;
+            }
+            else {
+                uint32_t instr = mem->read32(addr);
+                op.handler.arm = armDispatch[armIndex(instr)];
+                op.instr = instr;
+                last = endsBlockARM(instr, op.handler.arm);
+                addr += 4;
+            }
+
+            b->ops.push_back(op);
+            if (last) break;
+        }
+
+        b->end = addr;
+        b->idle = isIdleLoop(*b);
+        return blocks.insert(std::move(b));
+    }
+
+    // -------------------------------------------------
+    // IDLE LOOPS
+    // -------------------------------------------------
+    // A block that branches back to its own start, stores nothing and
+    // carries no register or flag state from one pass to the next does
+    // the same thing every time around: only an event (IRQ, DMA, timer,
+    // video) can change what it reads. Typical cases are B . and polling
+    // a register until VBlank. Once such a block has looped, the run
+    // loop skips ahead to the next event. A block seen reading a timer
+    // counter waits on the clock instead and loses its idle mark.
+    enum FLAG_USE {
+        FLAGS_NONE = 0,
+        FLAGS_NZ = 1,
+        FLAGS_ALL = 2
+    };
+
+    struct RegUse {
+        bool ok = false;
+        uint16_t reads = 0;
+        uint16_t writes = 0;
+        uint8_t flags = FLAGS_NONE;     // flags the op sets
+    };
+
+    // Unconditional ALU ops and loads without writeback; anything that
+    // reads the carry, stores, or writes R15 is rejected
+    static RegUse armUse(uint32_t instr) {
+        RegUse u;
+        if ((instr >> 28) != 0xE) return u;
+
+        uint32_t Rn = (instr >> 16) & 0xF;
+        uint32_t Rd = (instr >> 12) & 0xF;
+        uint32_t Rm = instr & 0xF;
+        bool I = instr & (1 << 25);
+        bool rrx = !I && ((instr >> 4) & 7) == 6 && !((instr >> 7) & 0x1F);
+        if (Rd == 15 || rrx) return u;
+
+        switch ((instr >> 26) & 3) {
+        case 0: {
+            bool S = instr & (1 << 20);
+            uint32_t op = (instr >> 21) & 0xF;
+            if (!I && (instr & 0x90) == 0x90) return u;         // multiply/halfword
+            if (!S && (op & 0xC) == 0x8) return u;              // MRS/MSR
+            if (op >= 0x5 && op <= 0x7) return u;               // ADC/SBC/RSC
+
+            if (op != 0xD && op != 0xF) u.reads |= 1 << Rn;
+            if (!I) {
+                u.reads |= 1 << Rm;
+                if (instr & 0x10) u.reads |= 1 << ((instr >> 8) & 0xF);
+            }
+            if ((op & 0xC) != 0x8) u.writes |= 1 << Rd;
+            if (S) u.flags = (op >= 0x2 && op <= 0x4) || op == 0xA || op == 0xB ? FLAGS_ALL : FLAGS_NZ;
+            break;
+        }
+        case 1: {
+            bool P = instr & (1 << 24);
+            bool W = instr & (1 << 21);
+            bool L = instr & (1 << 20);
+            if (!L || !P || W) return u;
+
+            u.reads |= 1 << Rn;
+            if (I) u.reads |= 1 << Rm;
+            u.writes |= 1 << Rd;
+            break;
+        }
+        default:
+            return u;
+        }
+
+        u.ok = true;
+        return u;
+    }
+
+    // Thumb formats 1-4, 6, 7 and 9-11 (loads only)
+    static RegUse thumbUse(uint16_t instr) {
+        RegUse u;
+        uint32_t lo = instr & 7;            // Rd in most formats
+        uint32_t mid = (instr >> 3) & 7;    // Rs / Rb
+        uint32_t hi = (instr >> 8) & 7;     // Rd in the imm8 formats
+
+        if ((instr & 0xF800) == 0x1800) {               // 2: ADD/SUB
+            u.reads = 1 << mid;
+            if (!(instr & (1 << 10))) u.reads |= 1 << ((instr >> 6) & 7);
+            u.writes = 1 << lo;
+            u.flags = FLAGS_ALL;
+        }
+        else if ((instr & 0xE000) == 0x0000) {          // 1: shift by imm
+            u.reads = 1 << mid;
+            u.writes = 1 << lo;
+            u.flags = FLAGS_NZ;
+        }
+        else if ((instr & 0xE000) == 0x2000) {          // 3: MOV/CMP/ADD/SUB imm8
+            uint32_t op = (instr >> 11) & 3;
+            if (op != 0) u.reads = 1 << hi;
+            if (op != 1) u.writes = 1 << hi;
+            u.flags = op == 0 ? FLAGS_NZ : FLAGS_ALL;
+        }
+        else if ((instr & 0xFC00) == 0x4000) {          // 4: ALU
+            uint32_t op = (instr >> 6) & 0xF;
+            if (op == 0x5 || op == 0x6) return u;       // ADC/SBC
+            u.reads = 1 << mid;
+            if (op != 0x9 && op != 0xF) u.reads |= 1 << lo;
+            if (op != 0x8 && op != 0xA && op != 0xB) u.writes = 1 << lo;
+            u.flags = op >= 0x9 && op <= 0xB ? FLAGS_ALL : FLAGS_NZ;
+        }
+        else if ((instr & 0xF800) == 0x4800) {          // 6: LDR PC-relative
+            u.writes = 1 << hi;
+        }
+        else if ((instr & 0xFA00) == 0x5800) {          // 7: LDR/LDRB [Rb, Ro]
+            u.reads = (1 << mid) | (1 << ((instr >> 6) & 7));
+            u.writes = 1 << lo;
+        }
+        else if ((instr & 0xE800) == 0x6800 || (instr & 0xF800) == 0x8800) {  // 9/10: load imm5
+            u.reads = 1 << mid;
+            u.writes = 1 << lo;
+        }
+        else if ((instr & 0xF800) == 0x9800) {          // 11: LDR SP-relative
+            u.reads = 1 << 13;
+            u.writes = 1 << hi;
+        }
+        else {
+            return u;
+        }
+
+        u.ok = true;
+        return u;
+    }
+
+    bool isIdleLoop(const Block& b) const {
+        bool thumb = b.key & 1;
+        size_t n = b.ops.size();
+        uint32_t instr = b.ops[n - 1].instr;
+        uint32_t at = b.start + (uint32_t)(n - 1) * (thumb ? 2 : 4);
+
+        // The last op has to branch back to the start, with targets
+        // computed exactly as the branch handlers do
+        uint32_t cond = 0xE;
+        int32_t off;
+        if (thumb) {
+            if ((instr & 0xF800) == 0xE000) {
+                off = instr & 0x7FF;
+                if (off & 0x400) off |= 0xFFFFF800;
+            }
+            else if ((instr & 0xF000) == 0xD000 && ((instr >> 8) & 0xF) < 0xE) {
+                cond = (instr >> 8) & 0xF;
+                off = (int8_t)(instr & 0xFF);
+            }
+            else return false;
+            if (at + 4 + (off << 1) != b.start) return false;
+        }
+        else {
+            if ((instr & 0x0F000000) != 0x0A000000 || (instr >> 28) == 0xF) return false;
+            cond = instr >> 28;
+            off = instr & 0x00FFFFFF;
+            if (off & 0x00800000) off |= 0xFF000000;
+            if (at + 8 + (off << 2) != b.start) return false;
+        }
+
+        RegUse uses[MAX_BLOCK_OPS];
+        uint32_t allWrites = 0;
+        for (size_t i = 0; i + 1 < n; i++) {
+            uses[i] = thumb ? thumbUse((uint16_t)b.ops[i].instr) : armUse(b.ops[i].instr);
+            if (!uses[i].ok) return false;
+            allWrites |= uses[i].writes;
+        }
+
+        // No register may be read before this pass has written it
+        uint32_t written = 0;
+        uint8_t flags = FLAGS_NONE;
+        for (size_t i = 0; i + 1 < n; i++) {
+            if (uses[i].reads & ~written & allWrites) return false;
+            written |= uses[i].writes;
+            if (uses[i].flags) flags = uses[i].flags;
+        }
+
+        // ...and the branch only looks at flags this pass has set
+        if (cond == 0xE) return true;
+        bool nzOnly = cond <= 1 || cond == 4 || cond == 5;     // EQ NE MI PL
+        return flags == FLAGS_ALL || (flags == FLAGS_NZ && nzOnly);
+    }
+
+    // Runs one cached block, leaving it early once the clock reaches
+    // 'stop' or an event falls due
+    void runBlock(uint64_t stop = UINT64_MAX) {
+        blocks.releaseRetired();
+
+        // Fetch ignores the low PC bits, so the block key does too
+        uint32_t key = getFlag(T) ? (PC() & ~1u) | 1 : PC() & ~3u;
+        Block* b = blocks.find(key);
+        if (!b) b = compileBlock(key);
+
+        Scheduler& sched = mem->scheduler;
+        uint32_t pc = b->start;
+        if (b->idle) mem->clockRead = false;
+
+        if (key & 1) {
+            for (const CachedOp& op : b->ops) {
+                pc += 2;
+                PC() = pc;
+                addCycles(1);
+                (this->*op.handler.thumb)((uint16_t)op.instr);
+                if (PC() != pc) {
+                    addCycles(REFILL_CYCLES);
+                    break;
+                }
+                if (!b->valid || sched.now >= stop || sched.now >= sched.deadline) break;
+            }
+        }
+        else {
+            for (const CachedOp& op : b->ops) {
+                pc += 4;
+                PC() = pc;
+                addCycles(1);
+                if (checkCond(op.instr >> 28))
+                    (this->*op.handler.arm)(op.instr);
+                if (PC() != pc) {
+                    addCycles(REFILL_CYCLES);
+                    break;
+                }
+                if (!b->valid || sched.now >= stop || sched.now >= sched.deadline) break;
+            }
+        }
+
+        // Skipping ahead would jump past the count it is waiting for
+        if (b->idle && mem->clockRead) b->idle = false;
+
+        idleLoop = b->idle && b->valid && PC() == b->start;
+    }
+
+    // -------------------------------------------------
+    // JIT
+    // -------------------------------------------------
+    // ARM blocks from the block cache translated to host code. Thumb
+    // blocks, and hosts without a backend, use the cached interpreter.
+    JIT jit;
+    bool useJIT = false;
+
+    // Runs translated blocks until the clock reaches 'stop' (at most
+    // JIT::SLICE cycles on) or an event falls due. The translated code
+    // counts down jit.budget; jit.end is the clock value it counts to.
+    void runJIT(uint64_t stop = UINT64_MAX) {
+        if (!JIT::available() || getFlag(T)) {
+            jit.lastExit = -1;
+            runBlock(stop);
+            return;
+        }
+
+        blocks.releaseRetired();
+
+        uint32_t key = PC() & ~3u;
+        Block* b = blocks.find(key);
+        if (!b) b = compileBlock(key);
+
+        // Idle loops stay interpreted so the run loop sees them spin
+        if (b->idle) {
+            jit.lastExit = -1;
+            runBlock(stop);
+            return;
+        }
+
+        if (!b->native && !jit.translate(*this, key)) {
+            // Code buffer full: start over with an empty cache
+            blocks.invalidateAll();
+            jit.reset();
+            b = compileBlock(key);
+            if (!jit.translate(*this, key)) {
+                runBlock(stop);
+                return;
+            }
+        }
+
+        // Chain the exit that brought us here straight into this block
+        if (jit.lastExit >= 0)
+            jit.link(jit.lastExit, key, b->native);
+
+        Scheduler& sched = mem->scheduler;
+        jit.end = std::min({ stop, sched.deadline, sched.now + JIT::SLICE });
+        jit.budget = (int32_t)(jit.end - sched.now);
+        jit.lastExit = -1;
+        ((JIT::BlockFn)b->native)(this);
+        sched.now = jit.end - jit.budget;
+    }
+
+    // An instruction the translator left to the interpreter. The clock is
+    // brought up to date first so the handler sees the right time, and an
+    // event it schedules (an IRQ, a DMA) ends the slice on time.
+    void jitFallback(uint32_t instr) {
+        Scheduler& sched = mem->scheduler;
+        sched.now = jit.end - jit.budget;
+
+        uint32_t next = PC();
+        decodeARM(instr);
+        if (PC() != next) addCycles(REFILL_CYCLES);
+
+        jit.end = std::min(jit.end, sched.deadline);
+        jit.budget = (int32_t)((int64_t)jit.end - (int64_t)sched.now);
     }
 };
+
+inline const std::array<uint16_t, 16> CPU::condTable = CPU::buildCondTable();
+inline const std::array<CPU::ARMHandler, 4096> CPU::armTable = CPU::buildARMTable(true);
+inline const std::array<CPU::ARMHandler, 4096> CPU::armTableGeneric = CPU::buildARMTable(false);
+inline const std::array<CPU::ThumbHandler, 1024> CPU::thumbTable = CPU::buildThumbTable();
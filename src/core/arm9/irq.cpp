@@ -1,40 +1,66 @@
 #include "irq.h"
 #include "../arm9/cpu.h"
 
+static void onIRQ(void* ctx) {
+    static_cast<IRQ*>(ctx)->step();
+}
+
+static uint32_t readReg(void* ctx, uint32_t addr) {
+    return static_cast<IRQ*>(ctx)->read(addr);
+}
+
+static void writeReg(void* ctx, uint32_t addr, uint32_t v) {
+    static_cast<IRQ*>(ctx)->write(addr, v);
+}
+
+// IF e write-1-to-clear: escritas parciais nao podem ser mescladas com o
+// valor atual, senao limpariam os outros bits
+template <typename T>
+static void writeIF(void* ctx, uint32_t addr, T v) {
+    static_cast<IRQ*>(ctx)->write(0x04000214, (uint32_t)v << ((addr & 3) * 8));
+}
+
 void IRQ::init(CPU* c) {
     cpu = c;
+    cpu->mem->scheduler.setHandler(Scheduler::IRQ, onIRQ, this);
+
+    MMIO& io = cpu->mem->mmio;
+    io.on<uint32_t>(0x04000208, readReg, writeReg, this);    // IME
+    io.on<uint32_t>(0x04000210, readReg, writeReg, this);    // IE
+    io.on<uint32_t>(0x04000214, readReg, writeReg, this);    // IF
+    io.onWrite<uint16_t>(0x04000214, writeIF<uint16_t>, this);
+    io.onWrite<uint8_t>(0x04000214, writeIF<uint8_t>, this);
 }
 
 void IRQ::reset() {
     IME = IE = IF = 0;
+    pending = false;
 }
 
 void IRQ::request(uint32_t bit) {
     IF |= bit;
+    update();
 }
 
-void IRQ::step() {
-    if (!IME) return;
-
-    uint32_t pending = IE & IF;
-    if (!pending) return;
-
-    // limpa flag
-    IF &= ~pending;
+// Entrega como evento assim que a fatia atual da CPU terminar
+void IRQ::update() {
+    // Halt termina com IE & IF mesmo sem IME ou com CPSR.I ligado
+    if (IE & IF) cpu->halted = false;
 
-    // salva retorno
-    cpu->R[14] = cpu->PC() + (cpu->getFlag(CPU::T) ? 2 : 4);
-
-    // desabilita IRQ
-    IME = 0;
+    pending = IME && (IE & IF) && !(cpu->CPSR & CPU::I);
+    if (pending)
+        cpu->mem->scheduler.schedule(Scheduler::IRQ, 0);
+}
 
-    // fora ARM mode
-    cpu->setFlag(CPU::T, false);
+void IRQ::step() {
+    if (!pending) return;
 
-    // salta para handler
-    cpu->PC() = 0x00000018;
+#ifdef SYNPAD_TRACE_IRQ
+    printf("[IRQ] IE=%08X IF=%08X PC=%08X\n", IE, IF, cpu->PC());
+#endif
 
-    printf("[IRQ] Interrupt triggered\n");
+    // LR_irq = proxima instrucao + 4; o handler retorna com SUBS PC, LR, #4
+    cpu->enterException(CPU::MODE_IRQ, cpu->vectorBase() + 0x18, cpu->PC() + 4);
 }
 
 uint32_t IRQ::read(uint32_t addr) {
@@ -52,4 +78,5 @@ void IRQ::write(uint32_t addr, uint32_t v) {
     case 0x04000210: IE = v; break;
     case 0x04000214: IF &= ~v; break; // write-1-to-clear
     }
+    update();
 }
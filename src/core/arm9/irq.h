@@ -3,6 +3,9 @@
 
 struct CPU;
 
+// Define SYNPAD_TRACE_IRQ to log every interrupt taken
+// #define SYNPAD_TRACE_IRQ
+
 struct IRQ {
     CPU* cpu = nullptr;
 
@@ -10,10 +13,15 @@ struct IRQ {
     uint32_t IE = 0;
     uint32_t IF = 0;
 
+    // IME && (IE & IF) && CPSR.I clear; recomputed by update() whenever
+    // one of those changes, never polled
+    bool pending = false;
+
     void init(CPU* c);
     void reset();
 
     void request(uint32_t bit);
+    void update();
     void step();
 
     uint32_t read(uint32_t addr);
@@ -0,0 +1,590 @@
+#include "jit.h"
+#include "x64_emitter.h"
+#include "../arm9/cpu.h"
+
+#include <algorithm>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#if defined(SYNPAD_JIT_X64) && defined(SYNPAD_FASTMEM)
+#include <signal.h>
+#include <ucontext.h>
+#endif
+
+static uint8_t* allocExec(size_t size) {
+#ifdef _WIN32
+    return (uint8_t*)VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? nullptr : (uint8_t*)p;
+#endif
+}
+
+static void freeExec(uint8_t* p, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, size);
+#endif
+}
+
+#if defined(SYNPAD_JIT_X64) && defined(SYNPAD_FASTMEM)
+
+// Translated code of every JIT that emitted fastmem accesses
+static std::vector<JIT*> fastmemJITs;
+static struct sigaction previousSegv;
+
+static void onSegv(int sig, siginfo_t* info, void* uc) {
+    greg_t* g = ((ucontext_t*)uc)->uc_mcontext.gregs;
+    const uint8_t* resume;
+
+    for (JIT* j : fastmemJITs) {
+        if (j->handleFault((const uint8_t*)g[REG_RIP], (uint64_t*)&g[REG_RAX], (uint64_t)g[REG_RCX], &resume)) {
+            g[REG_RIP] = (greg_t)resume;
+            return;
+        }
+    }
+
+    // Not a fastmem site: whatever was installed before gets it
+    if (previousSegv.sa_flags & SA_SIGINFO)
+        previousSegv.sa_sigaction(sig, info, uc);
+    else if (previousSegv.sa_handler != SIG_DFL && previousSegv.sa_handler != SIG_IGN)
+        previousSegv.sa_handler(sig);
+    else
+        signal(sig, SIG_DFL);   // the access faults again and terminates
+}
+
+static void registerFastmem(JIT* jit) {
+    if (std::find(fastmemJITs.begin(), fastmemJITs.end(), jit) != fastmemJITs.end())
+        return;
+
+    static bool installed = false;
+    if (!installed) {
+        struct sigaction sa = {};
+        sa.sa_sigaction = onSegv;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGSEGV, &sa, &previousSegv);
+        installed = true;
+    }
+
+    fastmemJITs.push_back(jit);
+}
+
+static void unregisterFastmem(JIT* jit) {
+    std::erase(fastmemJITs, jit);
+}
+
+#else
+
+static void registerFastmem(JIT*) {}
+static void unregisterFastmem(JIT*) {}
+
+#endif
+
+JIT::~JIT() {
+    unregisterFastmem(this);
+    if (code) freeExec(code, CODE_SIZE);
+}
+
+#ifdef SYNPAD_JIT_X64
+
+namespace {
+
+using E = X64Emitter;
+
+#ifdef _WIN32
+constexpr int ARG0 = E::RCX;
+constexpr int ARG1 = E::RDX;
+#else
+constexpr int ARG0 = E::RDI;
+constexpr int ARG1 = E::RSI;
+#endif
+
+void interpret(CPU* cpu, uint32_t instr) {
+    cpu->jitFallback(instr);
+}
+
+// Emits one block. RBX holds the CPU pointer and R12 the fastmem arena
+// for the whole block; RAX, RCX, RDX and R8-R11 are scratch (caller-saved
+// on both ABIs).
+//
+// Cycles are charged as the interpreter charges them. Fixed costs add up
+// in 'uncharged' and come off the budget in one go before a call out and
+// at every exit; memory wait states depend on the address and are looked
+// up at run time. Like the interpreter, a block stops between two
+// instructions once the clock reaches the end of the slice.
+struct Translator {
+    E& e;
+    JIT& jit;
+    int32_t rOff;
+    int32_t cpsrOff;
+    int32_t lazyNZOff;
+    int32_t lazyAOff;
+    int32_t lazyBOff;
+    int32_t nzPendingOff;
+    int32_t cvOpOff;
+    int32_t budgetOff;
+    int32_t lastExitOff;
+    uint8_t* arena;
+    const Memory::Region* regions;
+    uint32_t coreCycle;
+    uint32_t uncharged = 0;
+
+    struct SideExit {
+        size_t patch;
+        uint32_t pc;
+        uint32_t uncharged;
+    };
+
+    std::vector<SideExit> sideExits;
+
+    int32_t reg(uint32_t r) const { return rOff + (int32_t)r * 4; }
+
+    // Fixed size (JIT::PROLOGUE_SIZE): linked exits jump past it
+    void prologue() {
+        e.push(E::RBX);
+        e.push(E::R12);
+        e.subRsp(40);       // Win64 shadow space, keeps RSP 16-byte aligned
+        e.mov64(E::RBX, ARG0);
+        e.movImm64(E::R12, (uint64_t)(uintptr_t)arena);
+    }
+
+    void epilogue() {
+        e.addRsp(40);
+        e.pop(E::R12);
+        e.pop(E::RBX);
+        e.ret();
+    }
+
+    void charge() {
+        if (uncharged) e.aluMemImm(E::SUB, E::RBX, budgetOff, uncharged);
+        uncharged = 0;
+    }
+
+    // Back to the dispatcher without linking. Only a side exit: the code
+    // after it still owes what was uncharged here.
+    void leave() {
+        e.aluMemImm(E::SUB, E::RBX, budgetOff, uncharged);
+        e.movStoreImm(E::RBX, lastExitOff, (uint32_t)-1);
+        epilogue();
+    }
+
+    // Leaves before the instruction at 'pc' if the budget has run out.
+    // The exit itself is emitted out of line after the block.
+    void checkBudget(uint32_t pc) {
+        e.aluMemImm(E::CMP, E::RBX, budgetOff, uncharged);
+        sideExits.push_back({ e.jccForward(E::CC_LE), pc, uncharged });
+    }
+
+    void emitSideExits() {
+        for (const SideExit& x : sideExits) {
+            e.bind(x.patch);
+            if (x.uncharged) e.aluMemImm(E::SUB, E::RBX, budgetOff, x.uncharged);
+            e.movStoreImm(E::RBX, reg(15), x.pc);
+            e.movStoreImm(E::RBX, lastExitOff, (uint32_t)-1);
+            epilogue();
+        }
+    }
+
+    int32_t addExit(uint32_t expect, uint8_t* cacheKey) {
+        JIT::Exit x;
+        x.jump = e.cursor();
+        x.cacheKey = cacheKey;
+        x.expect = expect;
+        jit.exits.push_back(x);
+        return (int32_t)jit.exits.size() - 1;
+    }
+
+    // Charges the block and leaves through linkable exits. Unlinked jumps
+    // have rel32 = 0 and fall into the path that reports the exit id.
+    void blockExit(const std::vector<uint32_t>& targets, bool indirect) {
+        std::vector<size_t> toRet, toUnlinked;
+
+        e.aluMemImm(E::SUB, E::RBX, budgetOff, uncharged);
+        uncharged = 0;
+        toUnlinked.push_back(e.jccForward(E::CC_LE));
+
+        for (uint32_t target : targets) {
+            e.aluMemImm(E::CMP, E::RBX, reg(15), target);
+            size_t next = e.jccForward(E::CC_NZ);
+            e.jmpForward();
+            int32_t id = addExit(target, nullptr);
+            e.movStoreImm(E::RBX, lastExitOff, id);
+            toRet.push_back(e.jmpForward());
+            e.bind(next);
+        }
+
+        if (indirect) {
+            e.testMemImm(E::RBX, cpsrOff, CPU::T);
+            toUnlinked.push_back(e.jccForward(E::CC_NZ));
+            e.aluMemImm(E::CMP, E::RBX, reg(15), JIT::NO_TARGET);
+            uint8_t* cacheKey = e.cursor() - 4;
+            size_t miss = e.jccForward(E::CC_NZ);
+            e.jmpForward();
+            int32_t id = addExit(JIT::NO_TARGET, cacheKey);
+            e.bind(miss);
+            e.movStoreImm(E::RBX, lastExitOff, id);
+            toRet.push_back(e.jmpForward());
+        }
+
+        for (size_t p : toUnlinked) e.bind(p);
+        e.movStoreImm(E::RBX, lastExitOff, (uint32_t)-1);
+        for (size_t p : toRet) e.bind(p);
+        epilogue();
+    }
+
+    // The handler charges its own extra cycles and reads the clock, so
+    // everything up to here is charged first
+    void fallback(uint32_t pc, uint32_t instr) {
+        uncharged += coreCycle;
+        charge();
+        e.movStoreImm(E::RBX, reg(15), pc);
+        e.mov64(ARG0, E::RBX);
+        e.movImm(ARG1, instr);
+        e.movImm64(E::RAX, (uint64_t)(uintptr_t)&interpret);
+        e.callReg(E::RAX);
+    }
+
+    // Leaves the block if a store inside it invalidated the block
+    void checkValid(const bool* valid) {
+        e.movImm64(E::RAX, (uint64_t)(uintptr_t)valid);
+        e.cmpByteMem(E::RAX, 0, 0);
+        size_t skip = e.jccForward(E::CC_NZ);
+        leave();
+        e.bind(skip);
+    }
+
+    // Flag-setting ops only record what the CPU's lazy flags need
+    void lazyNZ() {
+        e.movStore(E::RBX, lazyNZOff, E::RAX);
+        e.movStoreImm8(E::RBX, nzPendingOff, 1);
+    }
+
+    void lazyCV(int a, int b, uint8_t op) {
+        e.movStore(E::RBX, lazyAOff, a);
+        e.movStore(E::RBX, lazyBOff, b);
+        e.movStoreImm8(E::RBX, cvOpOff, op);
+    }
+
+    // Unconditional data processing without PC operands; false = not handled
+    bool dataProcessing(uint32_t instr) {
+        static constexpr E::Shift shiftOps[4] = { E::SHL, E::SHR, E::SAR, E::ROR };
+
+        if ((instr >> 28) != 0xE) return false;
+        if ((instr & 0x0C000000) != 0) return false;
+
+        bool I = instr & (1 << 25);
+        bool S = instr & (1 << 20);
+        uint32_t op = (instr >> 21) & 0xF;
+        uint32_t Rn = (instr >> 16) & 0xF;
+        uint32_t Rd = (instr >> 12) & 0xF;
+        uint32_t Rm = instr & 0xF;
+
+        bool test = (op & 0xC) == 0x8;
+        bool logical = op == 0x0 || op == 0x1 || op == 0x8 || op == 0x9 || op >= 0xC;
+
+        if (!I && (instr & 0x10)) return false;     // register shift, multiply, halfword
+        if (test && !S) return false;               // MRS / MSR
+        if (op >= 0x5 && op <= 0x7) return false;   // ADC / SBC / RSC
+        if (Rd == 15 || Rn == 15 || (!I && Rm == 15)) return false;
+
+        // operand2 -> ECX (immediates are rotated here, at translation time)
+        if (I) {
+            uint32_t rot = ((instr >> 8) & 0xF) * 2;
+            if (S && logical && rot) return false;  // shifter carry
+            e.movImm(E::RCX, std::rotr(instr & 0xFF, rot));
+        }
+        else {
+            uint32_t type = (instr >> 5) & 3;
+            uint32_t amount = (instr >> 7) & 0x1F;
+            if (amount == 0 && type != CPU::LSL) return false; // LSR/ASR #32, RRX
+            if (S && logical && amount) return false;
+
+            e.movLoad(E::RCX, E::RBX, reg(Rm));
+            if (amount) e.shiftImm(shiftOps[type], E::RCX, amount);
+        }
+
+        if (op != 0xD && op != 0xF)
+            e.movLoad(E::RAX, E::RBX, reg(Rn));
+
+        if (S) {
+            switch (op) {
+            case 0x2: case 0xA: lazyCV(E::RAX, E::RCX, CPU::CV_SUB); break;
+            case 0x3: lazyCV(E::RCX, E::RAX, CPU::CV_SUB); break;
+            case 0x4: case 0xB: lazyCV(E::RAX, E::RCX, CPU::CV_ADD); break;
+            }
+        }
+
+        switch (op) {
+        case 0x0: case 0x8: e.alu(E::AND, E::RAX, E::RCX); break;
+        case 0x1: case 0x9: e.alu(E::XOR, E::RAX, E::RCX); break;
+        case 0x2: case 0xA: e.alu(E::SUB, E::RAX, E::RCX); break;
+        case 0x3: e.alu(E::SUB, E::RCX, E::RAX); break;
+        case 0x4: case 0xB: e.alu(E::ADD, E::RAX, E::RCX); break;
+        case 0xC: e.alu(E::OR, E::RAX, E::RCX); break;
+        case 0xD: e.mov(E::RAX, E::RCX); break;
+        case 0xE: e.notReg(E::RCX); e.alu(E::AND, E::RAX, E::RCX); break;
+        case 0xF: e.mov(E::RAX, E::RCX); e.notReg(E::RAX); break;
+        }
+
+        if (op == 0x3) e.mov(E::RAX, E::RCX);
+
+        if (S) lazyNZ();
+        if (!test) e.movStore(E::RBX, reg(Rd), E::RAX);
+        uncharged += coreCycle;
+        return true;
+    }
+
+    // Unconditional LDR/STR/LDRB/STRB with an immediate offset, as one
+    // arena access; false = not handled
+    bool loadStore(uint32_t instr, uint32_t pc, const bool* valid) {
+        if (!arena) return false;
+        if ((instr >> 28) != 0xE) return false;
+        if ((instr & 0x0E000000) != 0x04000000) return false;
+
+        bool L = instr & (1 << 20);
+        bool W = instr & (1 << 21);
+        bool B = instr & (1 << 22);
+        bool U = instr & (1 << 23);
+        bool P = instr & (1 << 24);
+        uint32_t Rn = (instr >> 16) & 0xF;
+        uint32_t Rd = (instr >> 12) & 0xF;
+        uint32_t off = instr & 0xFFF;
+
+        if (Rn == 15 || Rd == 15) return false;
+        if (!P && W) return false;                  // LDRT / STRT
+
+        E::ALU adjust = U ? E::ADD : E::SUB;
+        bool writeback = W || !P;
+
+        // address -> ECX, writeback value -> EDX
+        e.movLoad(E::RCX, E::RBX, reg(Rn));
+        if (P && off) e.aluImm(adjust, E::RCX, off);
+        if (writeback) {
+            e.mov(E::RDX, E::RCX);
+            if (!P && off) e.aluImm(adjust, E::RDX, off);
+        }
+        if (!B) e.aluImm(E::AND, E::RCX, ~3u);
+        if (!L) e.movLoad(E::RAX, E::RBX, reg(Rd));
+
+        uncharged += coreCycle;
+
+        const uint8_t* start = e.cursor();
+        if (L && B) e.movzx8LoadIndex(E::RAX, E::R12, E::RCX);
+        else if (L) e.movLoadIndex(E::RAX, E::R12, E::RCX);
+        else if (B) e.movStore8Index(E::R12, E::RCX, E::RAX);
+        else e.movStoreIndex(E::R12, E::RCX, E::RAX);
+        jit.sites.push_back({ start, (uint8_t)(e.cursor() - start), (uint8_t)(B ? 1 : 4), !L, uncharged });
+
+        // budget -= regions[addr >> 24].wait[width] * BUS_CYCLE
+        static_assert(sizeof(Memory::Region) == 16 && Memory::BUS_CYCLE == 2);
+        e.mov(E::R8, E::RCX);
+        e.shiftImm(E::SHR, E::R8, 24);
+        e.shiftImm(E::SHL, E::R8, 4);
+        e.movImm64(E::R9, (uint64_t)(uintptr_t)&regions[0].wait[B ? 0 : 2]);
+        e.movzx8LoadIndex(E::R8, E::R9, E::R8);
+        e.alu(E::ADD, E::R8, E::R8);
+        e.aluMem(E::SUB, E::RBX, budgetOff, E::R8);
+
+        // and one more for a load to write back its register
+        if (L) uncharged += coreCycle;
+
+        if (L) e.movStore(E::RBX, reg(Rd), E::RAX);
+        if (writeback) e.movStore(E::RBX, reg(Rn), E::RDX);
+
+        // a store may have hit this block (the handler invalidated it)
+        if (!L) {
+            e.movImm64(E::RAX, (uint64_t)(uintptr_t)valid);
+            e.cmpByteMem(E::RAX, 0, 0);
+            size_t skip = e.jccForward(E::CC_NZ);
+            e.movStoreImm(E::RBX, reg(15), pc);
+            leave();
+            e.bind(skip);
+        }
+        return true;
+    }
+};
+
+} // namespace
+
+JIT::BlockFn JIT::translate(CPU& cpu, uint32_t key) {
+    if (!code) {
+        code = allocExec(CODE_SIZE);
+        if (!code) return nullptr;
+    }
+
+    CPU::Block* b = cpu.blocks.find(key);
+    if (!b || (key & 1)) return nullptr;
+
+    X64Emitter e(code + used, CODE_SIZE - used);
+    Translator t{ e, *this,
+        (int32_t)((uint8_t*)cpu.R - (uint8_t*)&cpu),
+        (int32_t)((uint8_t*)&cpu.CPSR - (uint8_t*)&cpu),
+        (int32_t)((uint8_t*)&cpu.lazyNZ - (uint8_t*)&cpu),
+        (int32_t)((uint8_t*)&cpu.lazyA - (uint8_t*)&cpu),
+        (int32_t)((uint8_t*)&cpu.lazyB - (uint8_t*)&cpu),
+        (int32_t)((uint8_t*)&cpu.nzPending - (uint8_t*)&cpu),
+        (int32_t)((uint8_t*)&cpu.cvOp - (uint8_t*)&cpu),
+        (int32_t)((uint8_t*)&budget - (uint8_t*)&cpu),
+        (int32_t)((uint8_t*)&lastExit - (uint8_t*)&cpu),
+        cpu.mem->fastmem.arena,
+        cpu.mem->regions,
+        cpu.coreCycle };
+
+    if (t.arena) {
+        mem = cpu.mem;
+        registerFastmem(this);
+    }
+
+    size_t exitCount = exits.size();
+    size_t siteCount = sites.size();
+
+    t.prologue();
+
+    uint32_t pc = b->start;
+    int count = (int)b->ops.size();
+
+    for (int i = 0; i < count - 1; i++) {
+        uint32_t instr = b->ops[i].instr;
+        if (i) t.checkBudget(pc);
+        pc += 4;
+
+        if (t.dataProcessing(instr)) continue;
+        if (t.loadStore(instr, pc, &b->valid)) continue;
+
+        t.fallback(pc, instr);
+        t.checkValid(&b->valid);
+    }
+
+    // Last instruction: work out where the block can go next. The handler
+    // may change PC, so PC is written before the call and left alone after.
+    const CPU::CachedOp& last = b->ops.back();
+    std::vector<uint32_t> targets;
+    bool indirect = false;
+    if (count > 1) t.checkBudget(pc);
+    pc += 4;
+
+    // BLX imm (cond NV) lands in Thumb code and leaves as an indirect exit
+    if (last.handler.arm == &CPU::execBranch && (last.instr >> 28) != 0xF) {
+        int32_t off = last.instr & 0x00FFFFFF;
+        if (off & 0x00800000) off |= 0xFF000000;
+        targets.push_back(pc + 4 + (off << 2));
+        if ((last.instr >> 28) != 0xE) targets.push_back(pc);
+        t.fallback(pc, last.instr);
+    }
+    else if (last.handler.arm == &CPU::execSWI) {
+        // Halt and IntrWait stop the core: go back to the run loop so it
+        // sees 'halted' instead of chaining into the next block
+        t.fallback(pc, last.instr);
+    }
+    else if (!CPU::endsBlockARM(last.instr, last.handler.arm)) {
+        // Block was cut at MAX_BLOCK_OPS: fall through to the next one
+        targets.push_back(pc);
+        if (t.dataProcessing(last.instr) || t.loadStore(last.instr, pc, &b->valid))
+            e.movStoreImm(E::RBX, t.reg(15), pc);
+        else
+            t.fallback(pc, last.instr);
+    }
+    else {
+        indirect = true;
+        t.fallback(pc, last.instr);
+    }
+
+    t.blockExit(targets, indirect);
+    t.emitSideExits();
+
+    if (e.overflow()) {
+        exits.resize(exitCount);
+        sites.resize(siteCount);
+        return nullptr;
+    }
+
+    BlockFn fn = (BlockFn)(code + used);
+    used += e.pos;
+    b->native = (void*)fn;
+    return fn;
+}
+
+void JIT::link(int32_t id, uint32_t key, const void* native) {
+    Exit& x = exits[id];
+    if (!x.cacheKey && x.expect != key) return;
+    if (x.target == key) return;
+
+    if (x.target != NO_TARGET) std::erase(incoming[x.target], id);
+    if (x.cacheKey) memcpy(x.cacheKey, &key, 4);
+
+    X64Emitter::patchJump(x.jump, (const uint8_t*)native + PROLOGUE_SIZE);
+    x.target = key;
+    incoming[key].push_back(id);
+}
+
+void JIT::unlink(uint32_t key) {
+    auto it = incoming.find(key);
+    if (it == incoming.end()) return;
+
+    for (int32_t id : it->second) {
+        Exit& x = exits[id];
+        if (x.target != key) continue;
+
+        X64Emitter::patchJump(x.jump, x.jump);
+        if (x.cacheKey) memcpy(x.cacheKey, &NO_TARGET, 4);
+        x.target = NO_TARGET;
+    }
+
+    incoming.erase(it);
+}
+
+bool JIT::handleFault(const uint8_t* rip, uint64_t* rax, uint64_t rcx, const uint8_t** resume) {
+    if (!code || rip < code || rip >= code + used) return false;
+
+    auto it = std::lower_bound(sites.begin(), sites.end(), rip,
+        [](const FastmemSite& s, const uint8_t* p) { return s.start < p; });
+    if (it == sites.end() || it->start != rip) return false;
+
+    // The access may read the clock or schedule an event: bring the
+    // clock up to date, and stop the slice at any new deadline
+    // Memory invalidates by physical address, so a store through any
+    // alias of a code page reaches the blocks on it
+    uint32_t addr = (uint32_t)rcx;
+    uint32_t wait = it->width == 1 ? mem->accessCycles<uint8_t>(addr) : mem->accessCycles<uint32_t>(addr);
+
+    Scheduler& s = mem->scheduler;
+    s.now = end - budget + it->pending + wait;
+
+    if (it->store) {
+        if (it->width == 1) mem->write8(addr, (uint8_t)*rax);
+        else mem->write32(addr, (uint32_t)*rax);
+    }
+    else {
+        *rax = it->width == 1 ? mem->read8(addr) : mem->read32(addr);
+    }
+
+    // The emitted code still charges both after the access
+    end = std::min(end, s.deadline);
+    budget = (int32_t)((int64_t)end - (int64_t)(s.now - it->pending - wait));
+
+    *resume = rip + it->length;
+    return true;
+}
+
+#else
+
+bool JIT::handleFault(const uint8_t*, uint64_t*, uint64_t, const uint8_t**) {
+    return false;
+}
+
+JIT::BlockFn JIT::translate(CPU&, uint32_t) {
+    return nullptr;
+}
+
+void JIT::link(int32_t, uint32_t, const void*) {}
+void JIT::unlink(uint32_t) {}
+
+#endif
@@ -0,0 +1,101 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SYNPAD_JIT_X64 1
+#endif
+
+struct CPU;
+struct Memory;
+
+// x86-64 translator for ARM-mode blocks from the CPU block cache.
+// Supported data-processing forms are emitted natively; everything else
+// calls back into the interpreter one instruction at a time.
+//
+// Translated blocks chain directly into each other. Every block exit
+// owns a patchable jump: static exits (B, BL, fall-through) compare PC
+// against their known target, indirect exits (BX, LDM/POP with PC, ...)
+// carry a one-entry inline cache. Exits are linked lazily by the
+// dispatcher and unlinked when their target block is invalidated.
+//
+// With fastmem enabled in Memory, immediate-offset LDR/STR(B) become a
+// single host access into the arena (R12 holds its base). A fault on one
+// of those sites is replayed through Memory by the SIGSEGV handler.
+struct JIT {
+    using BlockFn = void (*)(CPU*);
+
+    static constexpr size_t CODE_SIZE = 16 * 1024 * 1024;
+    static constexpr size_t PROLOGUE_SIZE = 20;
+    static constexpr int32_t SLICE = 1024;  // ARM9 cycles per dispatch
+    static constexpr uint32_t NO_TARGET = 0xFFFFFFFF;
+
+    struct Exit {
+        uint8_t* jump = nullptr;        // end of the patchable jmp rel32
+        uint8_t* cacheKey = nullptr;    // inline-cache compare imm32, null when static
+        uint32_t expect = NO_TARGET;    // static target PC
+        uint32_t target = NO_TARGET;    // block currently linked
+    };
+
+    uint8_t* code = nullptr;
+    size_t used = 0;
+
+    // Read and written by translated code. 'budget' counts ARM9 cycles
+    // down to 'end', the clock value the current dispatch runs to.
+    int32_t budget = 0;
+    int32_t lastExit = -1;
+    uint64_t end = 0;
+
+    std::vector<Exit> exits;
+    std::unordered_map<uint32_t, std::vector<int32_t>> incoming;
+
+    // Arena accesses in emitted code, in address order. The guest address
+    // is in ECX and the data in EAX when the site faults.
+    struct FastmemSite {
+        const uint8_t* start;
+        uint8_t length;
+        uint8_t width;          // 1 or 4 bytes
+        bool store;
+        uint32_t pending;       // fixed cycles run but not yet taken off 'budget'
+    };
+
+    std::vector<FastmemSite> sites;
+    Memory* mem = nullptr;
+
+    JIT() = default;
+    ~JIT();
+
+    JIT(const JIT&) = delete;
+    JIT& operator=(const JIT&) = delete;
+
+    static constexpr bool available() {
+#ifdef SYNPAD_JIT_X64
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Translates the cached block at key; nullptr when the code buffer is full
+    BlockFn translate(CPU& cpu, uint32_t key);
+
+    // Points exit 'id' at the translated block for 'key'
+    void link(int32_t id, uint32_t key, const void* native);
+
+    // Reverts every exit that jumps into the block for 'key'
+    void unlink(uint32_t key);
+
+    // Drops all translated code (callers must invalidate the blocks first)
+    void reset() {
+        used = 0;
+        lastExit = -1;
+        exits.clear();
+        incoming.clear();
+        sites.clear();
+    }
+
+    // Replays a faulting fastmem access; false if 'rip' is not a site
+    bool handleFault(const uint8_t* rip, uint64_t* rax, uint64_t rcx, const uint8_t** resume);
+};
@@ -0,0 +1,270 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+// Minimal x86-64 encoder: just the forms the ARM block translator uses.
+// Memory operands are [base + disp32] with a base that needs no SIB, or
+// [base + index] for the fastmem arena accesses.
+struct X64Emitter {
+
+    enum Reg {
+        RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+        R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12, R13 = 13, R14 = 14, R15 = 15
+    };
+
+    // Two-operand ALU opcodes ("op r/m32, r32") and their /digit for imm forms
+    enum ALU {
+        ADD = 0x01, OR = 0x09, AND = 0x21, SUB = 0x29, XOR = 0x31, CMP = 0x39
+    };
+
+    enum Shift {
+        ROL = 0, ROR = 1, SHL = 4, SHR = 5, SAR = 7
+    };
+
+    enum Cond {
+        CC_O = 0x0, CC_C = 0x2, CC_NC = 0x3, CC_Z = 0x4, CC_NZ = 0x5, CC_S = 0x8,
+        CC_LE = 0xE
+    };
+
+    uint8_t* buf = nullptr;
+    size_t pos = 0;
+    size_t cap = 0;
+
+    X64Emitter(uint8_t* b, size_t capacity) : buf(b), cap(capacity) {}
+
+    bool overflow() const { return pos > cap; }
+    uint8_t* cursor() const { return buf + pos; }
+
+    void byte(uint8_t v) { if (pos < cap) buf[pos] = v; pos++; }
+    void dword(uint32_t v) { for (int i = 0; i < 4; i++) byte(v >> (i * 8)); }
+    void qword(uint64_t v) { for (int i = 0; i < 8; i++) byte((uint8_t)(v >> (i * 8))); }
+
+    // -------------------------------------------------
+    // ENCODING HELPERS
+    // -------------------------------------------------
+    void rex(bool w, int reg, int rm, bool force = false) {
+        uint8_t r = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+        if (r != 0x40 || force) byte(r);
+    }
+
+    void rexIndex(bool w, int reg, int index, int base, bool force = false) {
+        uint8_t r = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+        if (r != 0x40 || force) byte(r);
+    }
+
+    // [base + index], base must not be RBP/R13 (those need a disp)
+    void modrmIndex(int reg, int base, int index) {
+        byte(0x04 | ((reg & 7) << 3));
+        byte(((index & 7) << 3) | (base & 7));
+    }
+
+    void modrmReg(int reg, int rm) {
+        byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    void modrmMem(int reg, int base, int32_t disp) {
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        dword(disp);
+    }
+
+    // -------------------------------------------------
+    // INSTRUCTIONS
+    // -------------------------------------------------
+    void movLoad(int dst, int base, int32_t disp) {   // mov r32, [base+disp]
+        rex(false, dst, base);
+        byte(0x8B);
+        modrmMem(dst, base, disp);
+    }
+
+    void movStore(int base, int32_t disp, int src) {  // mov [base+disp], r32
+        rex(false, src, base);
+        byte(0x89);
+        modrmMem(src, base, disp);
+    }
+
+    void movLoad64(int dst, int base, int32_t disp) {  // mov r64, [base+disp]
+        rex(true, dst, base);
+        byte(0x8B);
+        modrmMem(dst, base, disp);
+    }
+
+    void movLoadIndex(int dst, int base, int index) {   // mov r32, [base+index]
+        rexIndex(false, dst, index, base);
+        byte(0x8B);
+        modrmIndex(dst, base, index);
+    }
+
+    void movzx8LoadIndex(int dst, int base, int index) { // movzx r32, byte [base+index]
+        rexIndex(false, dst, index, base);
+        byte(0x0F);
+        byte(0xB6);
+        modrmIndex(dst, base, index);
+    }
+
+    void movStoreIndex(int base, int index, int src) {   // mov [base+index], r32
+        rexIndex(false, src, index, base);
+        byte(0x89);
+        modrmIndex(src, base, index);
+    }
+
+    void movStore8Index(int base, int index, int src) {  // mov [base+index], r8
+        rexIndex(false, src, index, base, src >= 4);
+        byte(0x88);
+        modrmIndex(src, base, index);
+    }
+
+    void movStoreImm(int base, int32_t disp, uint32_t imm) {
+        rex(false, 0, base);
+        byte(0xC7);
+        modrmMem(0, base, disp);
+        dword(imm);
+    }
+
+    void movStoreImm8(int base, int32_t disp, uint8_t imm) {
+        rex(false, 0, base);
+        byte(0xC6);
+        modrmMem(0, base, disp);
+        byte(imm);
+    }
+
+    void movImm(int dst, uint32_t imm) {
+        rex(false, 0, dst);
+        byte(0xB8 + (dst & 7));
+        dword(imm);
+    }
+
+    void movImm64(int dst, uint64_t imm) {
+        rex(true, 0, dst);
+        byte(0xB8 + (dst & 7));
+        qword(imm);
+    }
+
+    void mov(int dst, int src) {
+        rex(false, src, dst);
+        byte(0x89);
+        modrmReg(src, dst);
+    }
+
+    void mov64(int dst, int src) {
+        rex(true, src, dst);
+        byte(0x89);
+        modrmReg(src, dst);
+    }
+
+    void alu(ALU op, int dst, int src) {
+        rex(false, src, dst);
+        byte(op);
+        modrmReg(src, dst);
+    }
+
+    void aluImm(ALU op, int dst, uint32_t imm) {
+        rex(false, 0, dst);
+        byte(0x81);
+        modrmReg(op >> 3, dst);
+        dword(imm);
+    }
+
+    void aluMem(ALU op, int base, int32_t disp, int src) {  // op [base+disp], r32
+        rex(false, src, base);
+        byte(op);
+        modrmMem(src, base, disp);
+    }
+
+    void aluMemImm(ALU op, int base, int32_t disp, uint32_t imm) {
+        rex(false, 0, base);
+        byte(0x81);
+        modrmMem(op >> 3, base, disp);
+        dword(imm);
+    }
+
+    void testMemImm(int base, int32_t disp, uint32_t imm) {
+        rex(false, 0, base);
+        byte(0xF7);
+        modrmMem(0, base, disp);
+        dword(imm);
+    }
+
+    void test(int a, int b) {
+        rex(false, b, a);
+        byte(0x85);
+        modrmReg(b, a);
+    }
+
+    void notReg(int r) {
+        rex(false, 0, r);
+        byte(0xF7);
+        modrmReg(2, r);
+    }
+
+    void shiftImm(Shift op, int r, uint8_t amount) {
+        rex(false, 0, r);
+        byte(0xC1);
+        modrmReg(op, r);
+        byte(amount);
+    }
+
+    void setcc(Cond cc, int r) {
+        rex(false, 0, r, r >= 4);
+        byte(0x0F);
+        byte(0x90 + cc);
+        modrmReg(0, r);
+    }
+
+    void movzx8(int dst, int src) {
+        rex(false, dst, src, src >= 4);
+        byte(0x0F);
+        byte(0xB6);
+        modrmReg(dst, src);
+    }
+
+    void cmpByteMem(int base, int32_t disp, uint8_t imm) {
+        rex(false, 0, base);
+        byte(0x80);
+        modrmMem(7, base, disp);
+        byte(imm);
+    }
+
+    void push(int r) { rex(false, 0, r); byte(0x50 + (r & 7)); }
+    void pop(int r) { rex(false, 0, r); byte(0x58 + (r & 7)); }
+    void ret() { byte(0xC3); }
+
+    void callReg(int r) {
+        rex(false, 0, r);
+        byte(0xFF);
+        modrmReg(2, r);
+    }
+
+    void subRsp(uint8_t v) { byte(0x48); byte(0x83); byte(0xEC); byte(v); }
+    void addRsp(uint8_t v) { byte(0x48); byte(0x83); byte(0xC4); byte(v); }
+
+    // jcc rel32 with the target patched later; returns the patch offset
+    size_t jccForward(Cond cc) {
+        byte(0x0F);
+        byte(0x80 + cc);
+        dword(0);
+        return pos;
+    }
+
+    size_t jmpForward() {
+        byte(0xE9);
+        dword(0);
+        return pos;
+    }
+
+    void jmpTo(const uint8_t* target) {
+        byte(0xE9);
+        dword((uint32_t)(target - (buf + pos + 4)));
+    }
+
+    void bind(size_t patch) {
+        if (patch > cap) return;
+        uint32_t rel = (uint32_t)(pos - patch);
+        memcpy(buf + patch - 4, &rel, 4);
+    }
+
+    // Retargets an already emitted jmp/jcc rel32 ending at 'end'
+    static void patchJump(uint8_t* end, const uint8_t* target) {
+        uint32_t rel = (uint32_t)(target - end);
+        memcpy(end - 4, &rel, 4);
+    }
+};
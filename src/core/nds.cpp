@@ -0,0 +1,23 @@
+#include "nds.h"
+
+bool NDS::boot(const char* path) {
+    return mem9.cart.load(path) && mem9.cart.boot(arm9, arm7);
+}
+
+uint64_t NDS::runFor(uint64_t cycles) {
+    Scheduler& s9 = mem9.scheduler;
+    Scheduler& s7 = mem7.scheduler;
+    uint64_t start = s9.now;
+    uint64_t target = start + cycles;
+
+    while (s9.now < target) {
+        uint64_t step = std::min(std::max<uint64_t>(slice, 1), target - s9.now);
+        arm9.runFor(step);
+
+        // A block may overshoot; the ARM7 follows to the same point
+        if (s7.now < s9.now)
+            arm7.runFor(s9.now - s7.now);
+    }
+
+    return s9.now - start;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <cstdint>
+#include "../core/arm9/cpu.h"
+
+// Both cores and their buses. The ARM7 bus shares main RAM and WRAM with
+// the ARM9 one; each bus keeps its own IO, timers, DMA and IRQs, and both
+// schedulers count ARM9 cycles.
+//
+// The cores take turns of 'slice' cycles: the ARM9 runs to the end of the
+// slice, then the ARM7 catches up to where the ARM9 stopped. The order
+// depends only on the slice size, so runs are reproducible. Small slices
+// let each core see the other's writes sooner; large ones switch less
+// often and keep each core's code and data hot.
+struct NDS {
+    static constexpr uint64_t DEFAULT_SLICE = 64;
+
+    Memory mem9;
+    Memory mem7{ &mem9 };
+    CPU arm9{ &mem9 };
+    CPU arm7{ &mem7, CPU::ARM7 };
+
+    uint64_t slice = DEFAULT_SLICE;
+
+    // Maps the ROM and direct-boots both cores
+    bool boot(const char* path);
+
+    // Runs both cores for at least 'cycles' ARM9 cycles; returns the
+    // number actually run
+    uint64_t runFor(uint64_t cycles);
+};
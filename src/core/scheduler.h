@@ -0,0 +1,139 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Central event scheduler. Every timed thing outside the CPU (timer
+// overflow, DMA start, video timing, IRQ delivery) is one of a fixed set
+// of events with a timestamp in CPU cycles. The CPU runs until 'deadline'
+// and then calls runDue(); nothing is polled per instruction.
+//
+// Events live in a binary min-heap. Cancelling or rescheduling bumps the
+// event's generation, so stale heap entries are dropped when they surface
+// instead of being searched for.
+struct Scheduler {
+
+    enum Event {
+        IRQ,
+        DMA,
+        TIMER0, TIMER1, TIMER2, TIMER3,
+        HBLANK,
+        SCANLINE,
+        EVENT_COUNT
+    };
+
+    using Handler = void (*)(void* ctx);
+
+    uint64_t now = 0;                   // current time in CPU cycles
+    uint64_t deadline = UINT64_MAX;     // time of the earliest pending event
+
+    void setHandler(Event e, Handler fn, void* ctx) {
+        slots[e].fn = fn;
+        slots[e].ctx = ctx;
+    }
+
+    // Drops the handler only if it still belongs to 'ctx'
+    void clearHandler(Event e, void* ctx) {
+        if (slots[e].ctx == ctx)
+            slots[e] = {};
+    }
+
+    void schedule(Event e, uint64_t delay) {
+        scheduleAt(e, now + delay);
+    }
+
+    // Schedules (or moves) an event to an absolute time
+    void scheduleAt(Event e, uint64_t time) {
+        Slot& s = slots[e];
+        s.gen++;
+        s.pending = true;
+        s.time = time;
+
+        if (heap.size() >= MAX_STALE)
+            compact();
+        heap.push_back({ time, e, s.gen });
+        std::push_heap(heap.begin(), heap.end(), later);
+
+        deadline = std::min(deadline, time);
+    }
+
+    // Moves the clock forward from inside a handler, e.g. while DMA holds
+    // the bus; events that fall due meanwhile still fire in this runDue()
+    void stall(uint64_t cycles) { now += cycles; }
+
+    void cancel(Event e) {
+        slots[e].gen++;
+        slots[e].pending = false;
+    }
+
+    bool pending(Event e) const { return slots[e].pending; }
+
+    // When the event is (or was last) due; periodic handlers reschedule
+    // relative to this rather than to 'now' so they do not drift
+    uint64_t time(Event e) const { return slots[e].time; }
+
+    // Fires every event due at or before 'now', in time order
+    void runDue() {
+        while (!heap.empty() && heap.front().time <= now) {
+            Entry top = heap.front();
+            std::pop_heap(heap.begin(), heap.end(), later);
+            heap.pop_back();
+
+            Slot& s = slots[top.event];
+            if (top.gen != s.gen) continue;     // cancelled or moved
+
+            s.pending = false;
+            if (s.fn) s.fn(s.ctx);
+        }
+        updateDeadline();
+    }
+
+    void reset() {
+        now = 0;
+        heap.clear();
+        for (auto& s : slots) {
+            s.gen++;
+            s.pending = false;
+        }
+        deadline = UINT64_MAX;
+    }
+
+private:
+    struct Slot {
+        Handler fn = nullptr;
+        void* ctx = nullptr;
+        uint64_t time = 0;
+        uint32_t gen = 0;
+        bool pending = false;
+    };
+
+    struct Entry {
+        uint64_t time;
+        Event event;
+        uint32_t gen;
+    };
+
+    static constexpr size_t MAX_STALE = EVENT_COUNT * 8;
+
+    Slot slots[EVENT_COUNT];
+    std::vector<Entry> heap;
+
+    static bool later(const Entry& a, const Entry& b) { return a.time > b.time; }
+
+    void updateDeadline() {
+        while (!heap.empty() && heap.front().gen != slots[heap.front().event].gen) {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            heap.pop_back();
+        }
+        deadline = heap.empty() ? UINT64_MAX : heap.front().time;
+    }
+
+    // Rebuilds the heap from live events once stale entries pile up
+    void compact() {
+        heap.clear();
+        for (int e = 0; e < EVENT_COUNT; e++)
+            if (slots[e].pending)
+                heap.push_back({ slots[e].time, (Event)e, slots[e].gen });
+        std::make_heap(heap.begin(), heap.end(), later);
+    }
+};
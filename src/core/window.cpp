@@ -5,6 +5,7 @@
 #include "../gpu/opengl_backend/opengl_renderer.h"
 #include "../core/memory/memory.h"
 #include "../core/arm9/cpu.h"
+#include "../core/nds.h"
 #include <cstdlib>
 #include <ctime>
 
@@ -12,20 +13,29 @@
 #include <cassert>
 
 
-int main() {
+int main(int argc, char** argv) {
     // Inicializa GLFW
     if (!glfwInit()) {
         printf("Failed to initialize GLFW\n");
         return -1;
     }
 
-    Memory mem;
+    NDS nds;
 
-    mem.write32(0x02000000, 0x12345678);
-    uint32_t v = mem.read32(0x02000000);
+    nds.mem9.write32(0x02000000, 0x12345678);
+    uint32_t v = nds.mem9.read32(0x02000000);
 
     assert(v == 0x12345678);
 
+    // ROM passada na linha de comando: boot direto nos dois cores
+    if (argc > 1) {
+        if (!nds.boot(argv[1])) {
+            printf("Failed to boot %s\n", argv[1]);
+            return -1;
+        }
+        printf("%s [%s]\n", nds.mem9.cart.title().c_str(), nds.mem9.cart.gameCode().c_str());
+    }
+
 
     // Criar janela OpenGL 3.3 Core
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
@@ -59,6 +69,10 @@ int main() {
 
     // Loop principal
     while (!glfwWindowShouldClose(window)) {
+        // Emula um frame, uma scanline por vez
+        for (int line = 0; line < DS_SCANLINES; ++line)
+            nds.runFor(CYCLES_PER_SCANLINE);
+
         // Limpa tela
         gpu.clear();
 
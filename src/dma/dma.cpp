@@ -1,8 +1,52 @@
 #include "dma.h"
 #include "../memory/memory.h"
+#include "../core/arm9/irq.h"
+#include <algorithm>
+
+static constexpr uint32_t CNT_COUNT = 0x001FFFFF;
+static constexpr uint32_t CNT_COUNT_ARM7 = 0x00003FFF;     // 14 bits
+static constexpr uint32_t CNT_COUNT_ARM7_DMA3 = 0x0000FFFF;
+static constexpr uint32_t CNT_REPEAT = 1u << 25;
+static constexpr uint32_t CNT_WORD = 1u << 26;
+static constexpr uint32_t CNT_IRQ = 1u << 30;
+static constexpr uint32_t CNT_ENABLE = 1u << 31;
+
+// ARM7 channels have two timing bits (28-29) and fewer modes
+static constexpr DMA::StartMode ARM7_MODES[4] = {
+    DMA::START_IMMEDIATE, DMA::START_VBLANK, DMA::START_CARTRIDGE, DMA::START_GBA_SLOT
+};
+
+DMA::StartMode DMA::startMode(uint32_t cnt) const {
+    if (mem->arm7) return ARM7_MODES[(cnt >> 28) & 3];
+    return (StartMode)((cnt >> 27) & 7);
+}
+
+// Word count field of channel 'id'; a count of 0 means the field's maximum
+uint32_t DMA::countMask(int id) const {
+    if (!mem->arm7) return CNT_COUNT;
+    return id == 3 ? CNT_COUNT_ARM7_DMA3 : CNT_COUNT_ARM7;
+}
+
+static void onStart(void* ctx) {
+    static_cast<DMA*>(ctx)->step();
+}
+
+// DMAxSAD, DMAxDAD, DMAxCNT: 12 bytes per channel from 0x040000B0
+static uint32_t readReg(void* ctx, uint32_t addr) {
+    uint32_t off = addr - 0x040000B0;
+    return static_cast<DMA*>(ctx)->read(off / 12, (off % 12) / 4);
+}
+
+static void writeReg(void* ctx, uint32_t addr, uint32_t v) {
+    uint32_t off = addr - 0x040000B0;
+    static_cast<DMA*>(ctx)->write(off / 12, (off % 12) / 4, v);
+}
 
 void DMA::init(Memory* memory) {
     mem = memory;
+    mem->scheduler.setHandler(Scheduler::DMA, onStart, this);
+    for (uint32_t addr = 0x040000B0; addr < 0x040000E0; addr += 4)
+        mem->mmio.on<uint32_t>(addr, readReg, writeReg, this);
 }
 
 void DMA::reset() {
@@ -26,51 +70,145 @@ void DMA::write(int id, int reg, uint32_t v) {
     switch (reg) {
     case 0: d.src = v; break;
     case 1: d.dst = v; break;
-    case 2:
+    case 2: {
+        bool wasEnabled = d.cnt & CNT_ENABLE;
         d.cnt = v;
-        if (v & (1u << 31))
-            d.active = true;
+
+        if (!(v & CNT_ENABLE)) {
+            d.active = false;
+        }
+        else if (!wasEnabled) {
+            // the internal address registers load on the 0 -> 1 edge;
+            // timed channels then wait for trigger(), immediate ones
+            // start once the current CPU slice ends
+            d.curSrc = d.src;
+            d.curDst = d.dst;
+            if (startMode(v) == START_IMMEDIATE) {
+                d.active = true;
+                mem->scheduler.schedule(Scheduler::DMA, 0);
+            }
+        }
         break;
     }
+    }
+}
+
+void DMA::trigger(StartMode mode) {
+    bool any = false;
+    for (DMAChannel& d : ch) {
+        if ((d.cnt & CNT_ENABLE) && startMode(d.cnt) == mode) {
+            d.active = true;
+            any = true;
+        }
+    }
+    if (any)
+        mem->scheduler.schedule(Scheduler::DMA, 0);
 }
 
+// Channel 0 has the highest priority. The CPU is stalled while the bus
+// is busy: the clock moves past the transfer, and whatever fell due in
+// the meantime still fires in order.
 void DMA::step() {
+    uint64_t busy = 0;
     for (int i = 0; i < 4; i++) {
         if (ch[i].active)
-            execute(i);
+            busy += execute(i);
     }
+    mem->scheduler.stall(busy);
 }
 
-void DMA::execute(int id) {
+uint64_t DMA::execute(int id) {
     DMAChannel& d = ch[id];
 
-    uint32_t count = d.cnt & 0xFFFF;
+    uint32_t mask = countMask(id);
+    uint32_t count = d.cnt & mask;
     if (count == 0)
-        count = 0x10000;
+        count = mask + 1;
+
+    // Cleared first: a source may trigger the channel again while it is
+    // read (the game card has its next word ready)
+    d.active = false;
+    uint64_t cycles = (d.cnt & CNT_WORD) ? transfer<uint32_t>(d, count)
+                                         : transfer<uint16_t>(d, count);
 
-    bool word = d.cnt & (1 << 26);
+    // Timed channels with repeat stay armed for the next trigger
+    if ((d.cnt & CNT_REPEAT) && startMode(d.cnt) != START_IMMEDIATE) {
+        if (((d.cnt >> 21) & 3) == ADDR_RELOAD)
+            d.curDst = d.dst;
+    }
+    else {
+        d.cnt &= ~CNT_ENABLE;
+        d.active = false;
+    }
+
+    if ((d.cnt & CNT_IRQ) && mem->irq)
+        mem->irq->request(1 << (8 + id)); // DMA0 = bit 8
+
+    return cycles;
+}
 
-    uint32_t src = d.src;
-    uint32_t dst = d.dst;
+// Walks the transfer in runs that stay inside one page on both sides.
+// A run between plain memory is a single memmove, or a fill when the
+// source is fixed; runs touching MMIO (or code pages) go element by
+// element through the bus.
+template <typename T>
+uint64_t DMA::transfer(DMAChannel& d, uint32_t count) {
+    constexpr uint32_t size = sizeof(T);
+    uint64_t cycles = 0;
 
-    for (uint32_t i = 0; i < count; i++) {
-        if (word) {
-            uint32_t v = mem->read32(src);
-            mem->write32(dst, v);
-            src += 4;
-            dst += 4;
+    uint32_t srcMode = (d.cnt >> 23) & 3;
+    uint32_t dstMode = (d.cnt >> 21) & 3;
+    int32_t srcStep = srcMode == ADDR_DEC ? -(int32_t)size : srcMode == ADDR_FIXED ? 0 : size;
+    int32_t dstStep = dstMode == ADDR_DEC ? -(int32_t)size : dstMode == ADDR_FIXED ? 0 : size;
+
+    uint32_t src = d.curSrc & ~(size - 1);
+    uint32_t dst = d.curDst & ~(size - 1);
+
+    while (count) {
+        uint32_t n = 1;
+        uint64_t perElement = mem->waitStates<T>(src) + mem->waitStates<T>(dst);
+
+        if (srcStep >= 0 && dstStep > 0) {
+            uint32_t room = Memory::PAGE_SIZE - (dst & Memory::PAGE_MASK);
+            if (srcStep) room = std::min(room, Memory::PAGE_SIZE - (src & Memory::PAGE_MASK));
+            n = std::min(count, room / size);
+
+            uint32_t bytes = n * size;
+            uint8_t* to = mem->hostSpan(dst, bytes, true);
+            uint8_t* from = mem->hostSpan(src, srcStep ? bytes : size, false);
+
+            // a destination just ahead of the source repeats the data
+            // element by element, which memmove would not
+            bool overlap = srcStep && dst > src && dst - src < bytes;
+
+            if (to && from && !overlap) {
+                if (srcStep) {
+                    memmove(to, from, bytes);
+                }
+                else {
+                    T v;
+                    memcpy(&v, from, size);
+                    for (uint32_t i = 0; i < n; i++)
+                        memcpy(to + i * size, &v, size);
+                }
+                src += bytes * (srcStep != 0);
+                dst += bytes;
+                count -= n;
+                cycles += n * perElement;
+                continue;
+            }
         }
-        else {
-            uint16_t v = mem->read16(src);
-            mem->write16(dst, v);
-            src += 2;
-            dst += 2;
+
+        for (uint32_t i = 0; i < n; i++) {
+            mem->write<T>(dst, mem->read<T>(src));
+            src += srcStep;
+            dst += dstStep;
         }
+        count -= n;
+        cycles += n * perElement;
     }
 
-    d.src = src;
-    d.dst = dst;
-
-    d.active = false;
-    d.cnt &= ~(1u << 31);
+    d.curSrc = src;
+    d.curDst = dst;
+    return cycles * Memory::BUS_CYCLE;
 }
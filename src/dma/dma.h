@@ -4,13 +4,36 @@
 struct Memory; // forward declaration
 
 struct DMAChannel {
-    uint32_t src = 0;
+    uint32_t src = 0;       // DMAxSAD / DMAxDAD / DMAxCNT as written
     uint32_t dst = 0;
     uint32_t cnt = 0;
+
+    uint32_t curSrc = 0;    // internal address registers, loaded on enable
+    uint32_t curDst = 0;
     bool active = false;
 };
 
 struct DMA {
+    // DMAxCNT address control (bits 21-22 destination, 23-24 source)
+    enum AddrMode {
+        ADDR_INC = 0,
+        ADDR_DEC = 1,
+        ADDR_FIXED = 2,
+        ADDR_RELOAD = 3     // destination only: increment, reload on repeat
+    };
+
+    // DMAxCNT start timing (bits 27-29)
+    enum StartMode {
+        START_IMMEDIATE = 0,
+        START_VBLANK = 1,
+        START_HBLANK = 2,
+        START_DISPLAY = 3,      // start of each visible line
+        START_MAIN_MEMORY = 4,  // main memory display FIFO
+        START_CARTRIDGE = 5,
+        START_GBA_SLOT = 6,
+        START_GX_FIFO = 7
+    };
+
     Memory* mem = nullptr;
     DMAChannel ch[4];
 
@@ -20,6 +43,19 @@ struct DMA {
     void write(int id, int reg, uint32_t v);
     uint32_t read(int id, int reg);
 
+    // Arms every enabled channel waiting on 'mode'; they run together
+    // from one DMA event
+    void trigger(StartMode mode);
+
     void step();
-    void execute(int id);
+
+    // Runs one channel; returns the bus time it took, in CPU cycles
+    uint64_t execute(int id);
+
+private:
+    StartMode startMode(uint32_t cnt) const;
+    uint32_t countMask(int id) const;
+
+    template <typename T>
+    uint64_t transfer(DMAChannel& d, uint32_t count);
 };
@@ -8,6 +8,12 @@ constexpr int DS_WIDTH = 256;
 constexpr int DS_HEIGHT = 192;
 constexpr int VRAM_SIZE = DS_WIDTH * DS_HEIGHT * 4; // RGBA 8 bits por canal
 
+// Temporizacao de video em ciclos do ARM9 (67 MHz)
+constexpr int DS_SCANLINES = 263;                    // 192 visiveis + 71 de VBlank
+constexpr int CYCLES_PER_SCANLINE = 355 * 6 * 2;     // 355 dots, 6 ciclos de barramento cada
+constexpr int HBLANK_START = DS_WIDTH * 6 * 2;       // HBlank comeca apos 256 dots
+constexpr int CYCLES_PER_FRAME = CYCLES_PER_SCANLINE * DS_SCANLINES;
+
 struct GPU {
     std::vector<uint8_t> vram;   // VRAM do DS
     GPURenderer* renderer;          // Ponteiro para renderizador
@@ -0,0 +1,116 @@
+#include "video.h"
+#include "gpu.h"
+#include "../memory/memory.h"
+#include "../core/arm9/irq.h"
+
+// DISPSTAT
+static constexpr uint16_t STAT_VBLANK = 1 << 0;
+static constexpr uint16_t STAT_HBLANK = 1 << 1;
+static constexpr uint16_t STAT_VCOUNT = 1 << 2;
+static constexpr uint16_t STAT_VBLANK_IRQ = 1 << 3;
+static constexpr uint16_t STAT_HBLANK_IRQ = 1 << 4;
+static constexpr uint16_t STAT_VCOUNT_IRQ = 1 << 5;
+static constexpr uint8_t STAT_READ_ONLY = STAT_VBLANK | STAT_HBLANK | STAT_VCOUNT;
+
+// IRQ bits
+static constexpr uint32_t IRQ_VBLANK = 1 << 0;
+static constexpr uint32_t IRQ_HBLANK = 1 << 1;
+static constexpr uint32_t IRQ_VCOUNT = 1 << 2;
+
+static void onHBlank(void* ctx) { static_cast<Video*>(ctx)->hblank(); }
+static void onScanline(void* ctx) { static_cast<Video*>(ctx)->scanline(); }
+
+// Escritas de 16 e 32 bits chegam aqui byte a byte. Os bits 0-2 do
+// DISPSTAT sao status e VCOUNT e mantido pela temporizacao: o jogo nao
+// escreve em nenhum dos dois.
+static void writeStat(void* ctx, uint32_t addr, uint8_t v) {
+    uint8_t* bytes = static_cast<Video*>(ctx)->mem->mmio.bytes;
+    switch (addr & 3) {
+    case 0: bytes[4] = (bytes[4] & STAT_READ_ONLY) | (v & ~STAT_READ_ONLY); break;
+    case 1: bytes[5] = v; break;
+    }
+}
+
+void Video::init(Memory* memory) {
+    mem = memory;
+    mem->scheduler.setHandler(Scheduler::HBLANK, onHBlank, this);
+    mem->scheduler.setHandler(Scheduler::SCANLINE, onScanline, this);
+    mem->mmio.onWrite<uint8_t>(0x04000004, writeStat, this);
+}
+
+void Video::reset() {
+    vcount = 0;
+    setDispstat(0);
+    mem->mmio.bytes[6] = mem->mmio.bytes[7] = 0;
+
+    uint64_t start = mem->scheduler.now;
+    mem->scheduler.scheduleAt(Scheduler::HBLANK, start + HBLANK_START);
+    mem->scheduler.scheduleAt(Scheduler::SCANLINE, start + CYCLES_PER_SCANLINE);
+}
+
+uint16_t Video::dispstat() const {
+    return mem->mmio.bytes[4] | (mem->mmio.bytes[5] << 8);
+}
+
+void Video::setDispstat(uint16_t v) {
+    mem->mmio.bytes[4] = v & 0xFF;
+    mem->mmio.bytes[5] = v >> 8;
+}
+
+void Video::hblank() {
+    uint16_t stat = dispstat() | STAT_HBLANK;
+    setDispstat(stat);
+
+    if ((stat & STAT_HBLANK_IRQ) && mem->irq)
+        mem->irq->request(IRQ_HBLANK);
+
+    // DMA de HBlank so dispara nas linhas visiveis
+    if (vcount < DS_HEIGHT)
+        mem->dma.trigger(DMA::START_HBLANK);
+
+    // relativo ao horario previsto, nao ao atual, para nao acumular atraso
+    Scheduler& s = mem->scheduler;
+    s.scheduleAt(Scheduler::HBLANK, s.time(Scheduler::HBLANK) + CYCLES_PER_SCANLINE);
+}
+
+void Video::scanline() {
+    vcount = (vcount + 1) % DS_SCANLINES;
+    mem->mmio.bytes[6] = vcount & 0xFF;
+    mem->mmio.bytes[7] = vcount >> 8;
+
+    uint16_t stat = dispstat() & ~STAT_HBLANK;
+    uint32_t irqs = 0;
+
+    if (vcount == DS_HEIGHT) {
+        stat |= STAT_VBLANK;
+        if (stat & STAT_VBLANK_IRQ) irqs |= IRQ_VBLANK;
+    }
+    else if (vcount == DS_SCANLINES - 1) {
+        stat &= ~STAT_VBLANK;
+    }
+
+    // VCOUNT alvo: bits 15-8 + bit 7 como bit 8
+    uint16_t target = (stat >> 8) | ((stat & 0x80) << 1);
+    if (vcount == target) {
+        stat |= STAT_VCOUNT;
+        if (stat & STAT_VCOUNT_IRQ) irqs |= IRQ_VCOUNT;
+    }
+    else {
+        stat &= ~STAT_VCOUNT;
+    }
+
+    setDispstat(stat);
+    if (irqs && mem->irq)
+        mem->irq->request(irqs);
+
+    if (vcount == DS_HEIGHT) {
+        mem->dma.trigger(DMA::START_VBLANK);
+    }
+    else if (vcount < DS_HEIGHT) {
+        mem->dma.trigger(DMA::START_DISPLAY);
+        mem->dma.trigger(DMA::START_MAIN_MEMORY);
+    }
+
+    Scheduler& s = mem->scheduler;
+    s.scheduleAt(Scheduler::SCANLINE, s.time(Scheduler::SCANLINE) + CYCLES_PER_SCANLINE);
+}
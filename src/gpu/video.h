@@ -0,0 +1,21 @@
+#pragma once
+#include <cstdint>
+
+struct Memory;
+
+// Temporizacao de video: HBlank, VBlank e VCOUNT como eventos do scheduler.
+// DISPSTAT (0x04000004) e VCOUNT (0x04000006) ficam no array io da Memory.
+struct Video {
+    Memory* mem = nullptr;
+    uint16_t vcount = 0;
+
+    void init(Memory* memory);
+    void reset();
+
+    void hblank();
+    void scanline();
+
+private:
+    uint16_t dispstat() const;
+    void setDispstat(uint16_t v);
+};
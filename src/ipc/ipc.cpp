@@ -0,0 +1,151 @@
+#include "ipc.h"
+#include "../memory/memory.h"
+#include "../core/arm9/irq.h"
+
+static constexpr uint32_t IPCSYNC = 0x04000180;
+static constexpr uint32_t IPCFIFOCNT = 0x04000184;
+static constexpr uint32_t IPCFIFOSEND = 0x04000188;
+static constexpr uint32_t IPCFIFORECV = 0x04100000;
+
+static constexpr uint32_t IRQ_IPC_SYNC = 1 << 16;
+static constexpr uint32_t IRQ_SEND_EMPTY = 1 << 17;
+static constexpr uint32_t IRQ_RECV_NOT_EMPTY = 1 << 18;
+
+static constexpr uint16_t CNT_WRITABLE = IPC::CNT_SEND_IRQ | IPC::CNT_RECV_IRQ | IPC::CNT_ENABLE;
+
+// IPCSYNC and IPCFIFOCNT are 16 bits wide; the upper halves of their
+// slots read as zero and ignore writes
+static uint16_t readSyncReg(void* ctx, uint32_t addr) {
+    return addr & 2 ? 0 : static_cast<IPC*>(ctx)->readSync();
+}
+
+static void writeSyncReg(void* ctx, uint32_t addr, uint16_t v) {
+    if (!(addr & 2)) static_cast<IPC*>(ctx)->writeSync(v);
+}
+
+static uint16_t readCnt(void* ctx, uint32_t addr) {
+    return addr & 2 ? 0 : static_cast<IPC*>(ctx)->readControl();
+}
+
+static void writeCnt(void* ctx, uint32_t addr, uint16_t v) {
+    if (!(addr & 2)) static_cast<IPC*>(ctx)->writeControl(v);
+}
+
+// The other byte keeps its enables; merging in what reads back would
+// write 1 to the error bit and acknowledge it
+static void writeCntByte(void* ctx, uint32_t addr, uint8_t v) {
+    if (addr & 2) return;
+    IPC* ipc = static_cast<IPC*>(ctx);
+    uint32_t shift = (addr & 1) * 8;
+    uint16_t cur = ipc->control & CNT_WRITABLE;
+    ipc->writeControl((uint16_t)((cur & ~(0xFFu << shift)) | (v << shift)));
+}
+
+static void writeSend(void* ctx, uint32_t, uint32_t v) {
+    static_cast<IPC*>(ctx)->push(v);
+}
+
+static uint32_t readRecv(void* ctx, uint32_t) {
+    return static_cast<IPC*>(ctx)->pop();
+}
+
+void IPC::init(Memory* memory) {
+    mem = memory;
+    mem->mmio.on<uint16_t>(IPCSYNC, readSyncReg, writeSyncReg, this);
+    mem->mmio.on<uint16_t>(IPCFIFOCNT, readCnt, writeCnt, this);
+    mem->mmio.onWrite<uint8_t>(IPCFIFOCNT, writeCntByte, this);
+    mem->mmio.onWrite<uint32_t>(IPCFIFOSEND, writeSend, this);
+    mem->mmio.onRead<uint32_t>(IPCFIFORECV, readRecv, this);
+}
+
+void IPC::reset() {
+    send.clear();
+    sync = 0;
+    control = 0;
+    lastRecv = 0;
+}
+
+void IPC::connect(IPC* other) {
+    remote = other;
+    other->remote = this;
+}
+
+void IPC::request(uint32_t bits) const {
+    if (mem->irq) mem->irq->request(bits);
+}
+
+// ---- IPCSYNC ----
+
+uint16_t IPC::readSync() const {
+    uint16_t in = remote ? (remote->sync & SYNC_OUT) >> 8 : 0;
+    return (sync & (SYNC_OUT | SYNC_IRQ_ENABLE)) | in;
+}
+
+void IPC::writeSync(uint16_t v) {
+    sync = v & (SYNC_OUT | SYNC_IRQ_ENABLE);
+    if ((v & SYNC_SEND_IRQ) && remote && (remote->sync & SYNC_IRQ_ENABLE))
+        remote->request(IRQ_IPC_SYNC);
+}
+
+// ---- FIFO ----
+
+uint16_t IPC::readControl() const {
+    uint16_t v = control & (CNT_WRITABLE | CNT_ERROR);
+
+    uint32_t out = send.size();
+    if (out == 0) v |= CNT_SEND_EMPTY;
+    if (out == FIFO_SIZE) v |= CNT_SEND_FULL;
+
+    uint32_t in = remote ? remote->send.size() : 0;
+    if (in == 0) v |= CNT_RECV_EMPTY;
+    if (in == FIFO_SIZE) v |= CNT_RECV_FULL;
+    return v;
+}
+
+void IPC::writeControl(uint16_t v) {
+    uint16_t old = control;
+
+    if (v & CNT_SEND_CLEAR) send.clear();
+    if (v & CNT_ERROR) control &= ~CNT_ERROR;
+    control = (control & CNT_ERROR) | (v & CNT_WRITABLE);
+
+    // Enabling an IRQ whose condition already holds raises it at once
+    if (!(old & CNT_SEND_IRQ) && (control & CNT_SEND_IRQ) && send.empty())
+        request(IRQ_SEND_EMPTY);
+    if (!(old & CNT_RECV_IRQ) && (control & CNT_RECV_IRQ) && remote && !remote->send.empty())
+        request(IRQ_RECV_NOT_EMPTY);
+}
+
+void IPC::push(uint32_t v) {
+    if (!(control & CNT_ENABLE)) return;
+
+    bool wasEmpty = send.empty();
+    if (!send.push(v)) {
+        control |= CNT_ERROR;
+        return;
+    }
+    if (wasEmpty && remote && (remote->control & CNT_RECV_IRQ))
+        remote->request(IRQ_RECV_NOT_EMPTY);
+}
+
+uint32_t IPC::pop() {
+    if (!remote) return lastRecv;
+    FIFO& recv = remote->send;
+
+    // A disabled FIFO shows its oldest word without taking it
+    if (!(control & CNT_ENABLE)) {
+        uint32_t v;
+        return recv.peek(v) ? v : lastRecv;
+    }
+
+    uint32_t v;
+    if (!recv.pop(v)) {
+        control |= CNT_ERROR;
+        return lastRecv;
+    }
+    lastRecv = v;
+
+    if (recv.empty() && (remote->control & CNT_SEND_IRQ))
+        remote->request(IRQ_SEND_EMPTY);
+    return v;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+#include "../utils/spsc_ring.h"
+
+struct Memory;
+
+// IPCSYNC, IPCFIFOCNT and the FIFO ports, one set per core. Each core
+// owns its send FIFO and the other core reads it as its receive FIFO, so
+// every ring has exactly one producer and one consumer and needs no lock.
+struct IPC {
+    static constexpr uint32_t FIFO_SIZE = 16;
+
+    // IPCSYNC (0x04000180)
+    static constexpr uint16_t SYNC_IN = 0x000F;         // the other core's output
+    static constexpr uint16_t SYNC_OUT = 0x0F00;
+    static constexpr uint16_t SYNC_SEND_IRQ = 1 << 13;  // write only
+    static constexpr uint16_t SYNC_IRQ_ENABLE = 1 << 14;
+
+    // IPCFIFOCNT (0x04000184)
+    static constexpr uint16_t CNT_SEND_EMPTY = 1 << 0;
+    static constexpr uint16_t CNT_SEND_FULL = 1 << 1;
+    static constexpr uint16_t CNT_SEND_IRQ = 1 << 2;
+    static constexpr uint16_t CNT_SEND_CLEAR = 1 << 3;  // write only
+    static constexpr uint16_t CNT_RECV_EMPTY = 1 << 8;
+    static constexpr uint16_t CNT_RECV_FULL = 1 << 9;
+    static constexpr uint16_t CNT_RECV_IRQ = 1 << 10;
+    static constexpr uint16_t CNT_ERROR = 1 << 14;      // write 1 to acknowledge
+    static constexpr uint16_t CNT_ENABLE = 1 << 15;
+
+    using FIFO = SPSCRing<uint32_t, FIFO_SIZE>;
+
+    Memory* mem = nullptr;
+    IPC* remote = nullptr;      // the other core's, once both buses exist
+
+    FIFO send;                  // filled here, drained by 'remote'
+    uint16_t sync = 0;          // output bits and IRQ enable as written
+    uint16_t control = 0;       // IRQ enables, error and enable bits
+    uint32_t lastRecv = 0;      // what an empty receive FIFO reads as
+
+    void init(Memory* memory);
+    void reset();
+
+    // Pairs the two cores' registers
+    void connect(IPC* other);
+
+    uint16_t readSync() const;
+    void writeSync(uint16_t v);
+    uint16_t readControl() const;
+    void writeControl(uint16_t v);
+
+    // IPCFIFOSEND (0x04000188) and IPCFIFORECV (0x04100000)
+    void push(uint32_t v);
+    uint32_t pop();
+
+private:
+    void request(uint32_t bits) const;
+};
@@ -0,0 +1,119 @@
+#include "fastmem.h"
+
+#ifdef SYNPAD_FASTMEM
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+Fastmem::~Fastmem() {
+    if (arena) munmap(arena, ARENA_SIZE);
+    if (backing) munmap(backing, backingSize);
+    if (fd >= 0) close(fd);
+}
+
+bool Fastmem::init(size_t size) {
+    fd = memfd_create("synpad-ram", 0);
+    if (fd < 0) {
+        printf("Fastmem: memfd_create failed (%s)\n", strerror(errno));
+        return false;
+    }
+
+    if (ftruncate(fd, size) != 0) {
+        printf("Fastmem: ftruncate failed (%s)\n", strerror(errno));
+        close(fd);
+        fd = -1;
+        return false;
+    }
+
+    void* b = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    void* a = mmap(nullptr, ARENA_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (b == MAP_FAILED || a == MAP_FAILED) {
+        printf("Fastmem: mmap failed (%s)\n", strerror(errno));
+        if (b != MAP_FAILED) munmap(b, size);
+        if (a != MAP_FAILED) munmap(a, ARENA_SIZE);
+        close(fd);
+        fd = -1;
+        return false;
+    }
+
+    backing = (uint8_t*)b;
+    backingSize = size;
+    arena = (uint8_t*)a;
+    return true;
+}
+
+// A mapping that did not take leaves the arena out of step with the page
+// tables. Closing all of it keeps it safe: every access then faults and
+// is replayed through Memory, which is slow but always right.
+void Fastmem::fail(const char* what) {
+    printf("Fastmem: %s failed (%s), using the slow path\n", what, strerror(errno));
+    failed = true;
+    if (mprotect(arena, ARENA_SIZE, PROT_NONE) != 0)
+        printf("Fastmem: mprotect of the arena failed (%s)\n", strerror(errno));
+}
+
+void Fastmem::clear() {
+    regions.clear();
+    if (failed) return;
+
+    void* p = mmap(arena, ARENA_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    if (p == MAP_FAILED) fail("mmap");
+}
+
+void Fastmem::map(uint32_t start, uint32_t end, size_t offset, uint32_t size, bool writable) {
+    regions.push_back({ start, end, offset, size, writable });
+    if (failed) return;
+
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+
+    for (uint64_t addr = start; addr < end; addr += size) {
+        uint64_t len = end - addr < size ? end - addr : size;
+        if (mmap(arena + addr, len, prot, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED) {
+            fail("mmap");
+            return;
+        }
+    }
+}
+
+// The region whose mapping is visible at guest address 'addr'
+const Fastmem::Region* Fastmem::top(uint64_t addr) const {
+    for (auto it = regions.rbegin(); it != regions.rend(); ++it)
+        if (addr >= it->start && addr < it->end) return &*it;
+    return nullptr;
+}
+
+// Every region that maps the page is covered, so a JIT store through
+// any alias faults; mirrors another region maps over are left alone
+void Fastmem::protect(size_t offset, bool writable) {
+    if (failed) return;
+
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+
+    for (const Region& r : regions) {
+        if (!r.writable || offset < r.offset || offset >= r.offset + r.size) continue;
+
+        uint32_t page = (uint32_t)(offset - r.offset) & ~(PAGE_SIZE - 1);
+        for (uint64_t a = r.start + page; a < r.end; a += r.size) {
+            if (top(a) != &r) continue;
+            if (mprotect(arena + a, PAGE_SIZE, prot) != 0) {
+                fail("mprotect");
+                return;
+            }
+        }
+    }
+}
+
+#else
+
+Fastmem::~Fastmem() {}
+bool Fastmem::init(size_t) { return false; }
+void Fastmem::clear() {}
+
+void Fastmem::map(uint32_t, uint32_t, size_t, uint32_t, bool) {}
+void Fastmem::protect(size_t, bool) {}
+void Fastmem::fail(const char*) {}
+
+#endif
@@ -0,0 +1,66 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__linux__)
+#define SYNPAD_FASTMEM 1
+#endif
+
+// Optional 4 GiB host reservation that mirrors the guest address space.
+// Guest memory lives in one memfd; every region (and each of its mirrors)
+// is mapped from it at arena + guest address, so a guest access is a
+// single host access. Everything else stays PROT_NONE: touching MMIO or
+// unmapped space faults, and the JIT's fault handler replays the access
+// through the Memory handlers. Code pages are write-protected the same way.
+struct Fastmem {
+    static constexpr uint64_t ARENA_SIZE = 1ull << 32;
+    static constexpr uint32_t PAGE_SIZE = 0x1000;
+
+    struct Region {
+        uint32_t start;
+        uint32_t end;
+        size_t offset;      // into the backing memory
+        uint32_t size;      // mirrored every 'size' bytes (power of two)
+        bool writable;
+    };
+
+    uint8_t* arena = nullptr;       // guest address 0
+    uint8_t* backing = nullptr;     // linear view of the backing memory
+    size_t backingSize = 0;
+    int fd = -1;
+    bool failed = false;            // a mapping call failed; the arena stays PROT_NONE
+    std::vector<Region> regions;
+
+    Fastmem() = default;
+    ~Fastmem();
+
+    Fastmem(const Fastmem&) = delete;
+    Fastmem& operator=(const Fastmem&) = delete;
+
+    static constexpr bool supported() {
+#ifdef SYNPAD_FASTMEM
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Creates the backing memory and reserves the arena
+    bool init(size_t size);
+
+    // Drops every mapping; the whole arena faults again
+    void clear();
+
+    // Maps [start, end) onto backing[offset, offset + size), mirrored.
+    // Later mappings cover earlier ones.
+    void map(uint32_t start, uint32_t end, size_t offset, uint32_t size, bool writable);
+
+    // Write-protects (or unprotects) the page at 'offset' into the backing
+    // memory wherever the arena shows it
+    void protect(size_t offset, bool writable);
+
+private:
+    const Region* top(uint64_t addr) const;
+    void fail(const char* what);
+};
@@ -1,99 +1,248 @@
 #include "../memory/memory.h"
-#include "../core/arm9/irq.h"
-#include "../timers/timer.h"
+#include <algorithm>
 
-Memory::Memory() {
-    memset(bios, 0, sizeof(bios));
-    memset(mainRAM, 0, sizeof(mainRAM));
-    memset(io, 0, sizeof(io));
-    for (auto& t : timers) t.reset();
+static constexpr uint32_t WRAMCNT = 0x04000247;     // ARM9
+static constexpr uint32_t WRAMSTAT = 0x04000241;    // ARM7, read-only
+
+// WRAMCNT shares its register slot with VRAMCNT_E-G, which stay plain bytes
+static void writeWRAMCNT(void* ctx, uint32_t addr, uint8_t v) {
+    Memory* m = static_cast<Memory*>(ctx);
+    if (addr == WRAMCNT) m->setWRAMCNT(v & 3);
+    else m->mmio.bytes[MMIO::offset(addr)] = v;
 }
 
-// ---------------- READ ----------------
+Memory::Memory() {
+    storage.assign(BIOS_SIZE + MAIN_RAM_SIZE + SHARED_WRAM_SIZE + ITCM_SIZE + DTCM_SIZE, 0);
+    assignStorage(storage.data());
 
-uint8_t Memory::read8(uint32_t addr) {
+    mapRegions();
+
+    for (int i = 0; i < 4; i++) {
+        timers[i].init(this, i);
+        timers[i].reset();
+    }
+    dma.init(this);
+    video.init(this);
+    video.reset();
+    cart.init(this);
+    ipc.init(this);
+    ipc.reset();
+
+    mmio.onWrite<uint8_t>(WRAMCNT, writeWRAMCNT, this);
+}
 
-    if (addr < BIOS_SIZE)
-        return bios[addr];
+Memory::Memory(Memory* arm9) : arm7(true), peer(arm9) {
+    arm9->peer = this;
+    wramcnt = arm9->wramcnt;
 
-    if (addr >= 0x02000000 && addr < 0x02000000 + MAIN_RAM_SIZE)
-        return mainRAM[addr - 0x02000000];
+    storage.assign(BIOS_SIZE + ARM7_WRAM_SIZE, 0);
+    assignStorage(storage.data());
 
-    if (addr >= 0x04000000 && addr < 0x04001000)
-        return io[addr - 0x04000000];
+    mapRegions();
 
-    return 0;
+    for (int i = 0; i < 4; i++) {
+        timers[i].init(this, i);
+        timers[i].reset();
+    }
+    dma.init(this);
+    video.init(this);
+    video.reset();
+    ipc.init(this);
+    ipc.reset();
+    ipc.connect(&arm9->ipc);
 }
 
-uint16_t Memory::read16(uint32_t addr) {
+Memory::~Memory() {
+    if (peer) {
+        peer->peer = nullptr;
+        peer->peerCode = nullptr;
+        peer->ipc.remote = nullptr;
+    }
+}
 
-    // TIMERS (0x04000100 - 0x0400010F)
-    if (addr >= 0x04000100 && addr <= 0x0400010F) {
-        int id = (addr - 0x04000100) / 4;
-        bool high = addr & 2;
+void Memory::assignStorage(uint8_t* base) {
+    bios = base;
+    arm9Memory = arm7 ? peer->bios : base;
 
-        if (high)
-            return timers.readCNT_H();
-        else
-            return timers.readCNT_L();
+    if (arm7) {
+        mainRAM = peer->mainRAM;
+        sharedWRAM = peer->sharedWRAM;
+        arm7WRAM = bios + BIOS_SIZE;
+        return;
     }
+
+    mainRAM = bios + BIOS_SIZE;
+    sharedWRAM = mainRAM + MAIN_RAM_SIZE;
+    itcm = sharedWRAM + SHARED_WRAM_SIZE;
+    dtcm = itcm + ITCM_SIZE;
 }
 
-uint32_t Memory::read32(uint32_t addr) {
+void Memory::mapRegions() {
+    for (Region& r : regions) r = {};
+    readPage.assign(PAGE_COUNT, nullptr);
+    writePage.assign(PAGE_COUNT, nullptr);
+    if (fastmem.arena) fastmem.clear();
+
+    // Nominal bus timings; main RAM is 16 bits wide
+    setRegion(0x00, bios, BIOS_SIZE, 0, 1, 1, 1);
+    setRegion(0x02, mainRAM, MAIN_RAM_SIZE, WIDTH_ALL, 8, 8, 9);
+    mapSharedWRAM();
+    setRegion(0x04, nullptr, 0, WIDTH_ALL, 2, 2, 2);
+
+    // The upper half of the ARM7's WRAM area is always its own memory
+    if (arm7) {
+        map(0x03800000, 0x04000000, arm7WRAM, ARM7_WRAM_SIZE, true);
+        return;
+    }
 
-    if (irq && addr >= 0x04000208 && addr <= 0x04000214)
-        return irq->read(addr);
+    // The ARM9 BIOS sits at 0xFFFF0000, where the high vectors point
+    setRegion(0xFF, bios, BIOS_SIZE, 0, 1, 1, 1);
+
+    // The TCMs sit on top of whatever the page table maps there; they are
+    // page aligned and at least a page long, so no finer check is needed
+    // on the access paths
+    if (dtcmRegion.enabled)
+        map(dtcmRegion.base, dtcmRegion.base + dtcmRegion.size, dtcm, DTCM_SIZE, true);
+    if (itcmRegion.enabled)
+        map(0, itcmRegion.size, itcm, ITCM_SIZE, true);
+}
 
-    if (addr >= 0x040000B0 && addr <= 0x040000DF) {
-        int id = (addr - 0x040000B0) / 12;
-        int reg = ((addr - 0x040000B0) % 12) / 4;
-        return dma.read(id, reg);
+// 0x03000000-0x03FFFFFF, as split by WRAMCNT. On the ARM7 an empty share
+// shows its own WRAM instead.
+void Memory::mapSharedWRAM() {
+    constexpr uint32_t HALF = SHARED_WRAM_SIZE / 2;
+
+    uint8_t* base = nullptr;
+    uint32_t size = 0;
+    switch (arm7 ? 3 - wramcnt : wramcnt) {
+    case 0: base = sharedWRAM; size = SHARED_WRAM_SIZE; break;
+    case 1: base = sharedWRAM + HALF; size = HALF; break;
+    case 2: base = sharedWRAM; size = HALF; break;
     }
 
-    return read16(addr) | (read16(addr + 2) << 16);
+    if (arm7 && !base) {
+        base = arm7WRAM;
+        size = ARM7_WRAM_SIZE;
+    }
+    setRegion(0x03, base, size, WIDTH_ALL, 1, 1, 1);
 }
 
-// ---------------- WRITE ----------------
+void Memory::setWRAMCNT(uint8_t v) {
+    if (arm7) return;
 
-void Memory::write8(uint32_t addr, uint8_t v) {
+    remapWRAM(v);
+    if (peer) peer->remapWRAM(v);
+}
 
-    if (addr >= 0x02000000 && addr < 0x02000000 + MAIN_RAM_SIZE) {
-        mainRAM[addr - 0x02000000] = v;
-        return;
-    }
+void Memory::remapWRAM(uint8_t v) {
+    mmio.bytes[MMIO::offset(arm7 ? WRAMSTAT : WRAMCNT)] = v;
+    if (v == wramcnt) return;
 
-    if (addr >= 0x04000000 && addr < 0x04001000)
-        io[addr - 0x04000000] = v;
+    // Cached code in what just moved is stale
+    wramcnt = v;
+    if (code) code->invalidateAll();
+    mapRegions();
 }
 
-void Memory::write16(uint32_t addr, uint16_t v) {
+void Memory::setTCM(bool itcmOn, uint32_t itcmSize, bool dtcmOn, uint32_t dtcmBase, uint32_t dtcmSize) {
+    TCMRegion i{ itcmOn && itcmSize, 0, std::max(itcmSize, PAGE_SIZE) };
+    TCMRegion d{ dtcmOn && dtcmSize, dtcmBase, std::max(dtcmSize, PAGE_SIZE) };
+
+    // Bases wrap inside the region, as the base field ignores low bits
+    d.base &= ~(d.size - 1);
+    if ((uint64_t)d.base + d.size > 0x100000000ull) d.enabled = false;
 
-    if (addr >= 0x04000100 && addr <= 0x0400010F) {
-        int id = (addr - 0x04000100) / 4;
-        bool high = addr & 2;
-        if (high) timers[id].writeCNT_H(v);
-        else timers[id].writeCNT_L(v);
+    if (i.enabled == itcmRegion.enabled && i.size == itcmRegion.size &&
+        d.enabled == dtcmRegion.enabled && d.base == dtcmRegion.base && d.size == dtcmRegion.size)
         return;
+
+    itcmRegion = i;
+    dtcmRegion = d;
+
+    // Whatever was cached at the old or new addresses is stale now
+    if (code) code->invalidateAll();
+    mapRegions();
+}
+
+void Memory::setRegion(uint8_t area, uint8_t* base, uint32_t size, uint8_t writeWidths,
+                       uint8_t wait8, uint8_t wait16, uint8_t wait32) {
+    Region& r = regions[area];
+    r.base = base;
+    r.mask = size ? size - 1 : 0;
+    r.writeWidths = writeWidths;
+    r.wait[0] = wait8;
+    r.wait[1] = wait16;
+    r.wait[2] = wait32;
+
+    // Only memory that takes every write width can skip the slow path
+    if (base) {
+        uint32_t start = (uint32_t)area << 24;
+        map(start, start + 0x01000000, base, size, writeWidths == WIDTH_ALL);
+    }
+}
+
+void Memory::map(uint32_t start, uint32_t end, uint8_t* host, uint32_t size, bool writable) {
+    for (uint64_t addr = start; addr < end; addr += PAGE_SIZE) {
+        uint8_t* p = host + ((addr - start) & (size - 1));
+        readPage[addr >> PAGE_SHIFT] = p;
+        writePage[addr >> PAGE_SHIFT] = writable ? p : nullptr;
     }
 
-    write8(addr, v & 0xFF);
-    write8(addr + 1, v >> 8);
+    if (fastmem.arena)
+        fastmem.map(start, end, host - fastmem.backing, size, writable);
 }
 
-void Memory::write32(uint32_t addr, uint32_t v) {
+uint8_t* Memory::hostRange(uint32_t addr, uint32_t len, bool write) {
+    if (len == 0 || (uint64_t)addr + len > 0x100000000ull) return nullptr;
 
-    if (irq && addr >= 0x04000208 && addr <= 0x04000214) {
-        irq->write(addr, v);
-        return;
+    const std::vector<uint8_t*>& table = write ? writePage : readPage;
+    uint32_t first = addr >> PAGE_SHIFT;
+    uint32_t last = (addr + len - 1) >> PAGE_SHIFT;
+    uint8_t* base = table[first];
+    if (!base) return nullptr;
+
+    for (uint32_t p = first; p <= last; p++) {
+        if (table[p] != base + ((size_t)(p - first) << PAGE_SHIFT)) return nullptr;
+        if (write && codeAt(physical(table[p]))) return nullptr;
     }
+    return base + (addr & PAGE_MASK);
+}
 
-    if (addr >= 0x040000B0 && addr <= 0x040000DF) {
-        int id = (addr - 0x040000B0) / 12;
-        int reg = ((addr - 0x040000B0) % 12) / 4;
-        dma.write(id, reg, v);
-        return;
+void Memory::attachCodeTracker(CodeTracker* c) {
+    code = c;
+    if (peer) peer->peerCode = c;
+    if (!c) return;
+
+    // JIT stores to code pages must fault so the blocks get invalidated
+    c->onCodePage = [this](uint32_t page, bool) {
+        refreshCodePage(page);
+        if (peer) peer->refreshCodePage(page);
+    };
+}
+
+void Memory::refreshCodePage(uint32_t page) {
+    uint32_t phys = page << PAGE_SHIFT;
+    if (fastmem.arena) fastmem.protect(phys, !codeAt(phys));
+}
+
+bool Memory::enableFastmem() {
+    if (fastmem.arena) return true;
+    if (arm7) return false;
+    if (!fastmem.init(storage.size())) return false;
+
+    memcpy(fastmem.backing, storage.data(), storage.size());
+    assignStorage(fastmem.backing);
+    storage = {};
+
+    mapRegions();
+
+    // The ARM7 bus points into the memory that just moved
+    if (peer) {
+        peer->assignStorage(peer->storage.data());
+        peer->mapRegions();
     }
 
-    write16(addr, v & 0xFFFF);
-    write16(addr + 2, v >> 16);
+    for (uint32_t phys = 0; phys < ARM9_MEMORY_SIZE; phys += PAGE_SIZE)
+        if (codeAt(phys)) fastmem.protect(phys, false);
+    return true;
 }
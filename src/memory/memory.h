@@ -1,8 +1,16 @@
 #pragma once
 #include <cstdint>
 #include <cstring>
+#include <vector>
 
+#include "../cartridge/cartridge.h"
+#include "../core/arm9/block_cache.h"
+#include "../core/scheduler.h"
 #include "../dma/dma.h"
+#include "../gpu/video.h"
+#include "../ipc/ipc.h"
+#include "../memory/fastmem.h"
+#include "../memory/mmio.h"
 #include "../timers/timer.h"
 
 struct IRQ;
@@ -11,26 +19,254 @@ struct Memory {
 
     static constexpr uint32_t BIOS_SIZE = 0x4000;
     static constexpr uint32_t MAIN_RAM_SIZE = 4 * 1024 * 1024;
-    static constexpr uint32_t IO_SIZE = 0x1000;
+    static constexpr uint32_t ITCM_SIZE = 32 * 1024;
+    static constexpr uint32_t DTCM_SIZE = 16 * 1024;
+    static constexpr uint32_t SHARED_WRAM_SIZE = 32 * 1024;
+    static constexpr uint32_t ARM7_WRAM_SIZE = 64 * 1024;
 
-    uint8_t bios[BIOS_SIZE];
-    uint8_t mainRAM[MAIN_RAM_SIZE];
-    uint8_t io[IO_SIZE];
+    static constexpr uint32_t PAGE_SHIFT = 12;
+    static constexpr uint32_t PAGE_SIZE = 1u << PAGE_SHIFT;
+    static constexpr uint32_t PAGE_MASK = PAGE_SIZE - 1;
+    static constexpr uint32_t PAGE_COUNT = 1u << (32 - PAGE_SHIFT);
 
-    Timer timers;
+    // The bus runs at 33 MHz, half the ARM9 clock
+    static constexpr uint32_t BUS_CYCLE = 2;
+
+    static constexpr uint32_t ARM9_MEMORY_SIZE =
+        BIOS_SIZE + MAIN_RAM_SIZE + SHARED_WRAM_SIZE + ITCM_SIZE + DTCM_SIZE;
+    static constexpr uint32_t ARM7_PHYS = 0x00800000;
+
+    // Backed by 'storage', or by the fastmem memfd once it is enabled.
+    // The ARM7 bus has its own BIOS and WRAM and borrows main RAM and the
+    // shared WRAM from the ARM9 bus; it has no TCMs.
+    uint8_t* bios = nullptr;
+    uint8_t* mainRAM = nullptr;
+    uint8_t* sharedWRAM = nullptr;
+    uint8_t* itcm = nullptr;
+    uint8_t* dtcm = nullptr;
+    uint8_t* arm7WRAM = nullptr;
+    uint8_t* arm9Memory = nullptr;      // start of the ARM9 bus's memory (its BIOS)
+    MMIO mmio;
+
+    // The other core's bus, once an ARM7 bus has been created
+    bool arm7 = false;
+    Memory* peer = nullptr;
+
+    // WRAMCNT: how the shared WRAM is split (0: all ARM9 ... 3: all ARM7)
+    uint8_t wramcnt = 0;
+
+    // TCM placement as programmed through CP15. 'size' is the virtual
+    // size; the physical memory mirrors inside it.
+    struct TCMRegion {
+        bool enabled = false;
+        uint32_t base = 0;
+        uint32_t size = 0;
+    };
+
+    TCMRegion itcmRegion;
+    TCMRegion dtcmRegion;
+
+    std::vector<uint8_t> storage;
+    Fastmem fastmem;
+
+    Scheduler scheduler;
+    Timer timers[4];
     DMA dma;
+    Video video;
+    Cartridge cart;
+    IPC ipc;
+
+    // Set by reads whose value moves with the clock alone (the timer
+    // counters). A loop polling one is waiting on time, not on an event.
+    bool clockRead = false;
 
     IRQ* irq = nullptr;
+    CodeTracker* code = nullptr;
+    CodeTracker* peerCode = nullptr;    // the other core's, for shared memory
 
-    Memory();
+    // Host pointer for each 4 KiB guest page of plain memory. A null
+    // entry means MMIO or unmapped, and the access takes the slow path.
+    std::vector<uint8_t*> readPage;
+    std::vector<uint8_t*> writePage;
+
+    Memory();                       // ARM9 bus
+    explicit Memory(Memory* arm9);  // ARM7 bus, sharing memory with 'arm9'
+    ~Memory();
+
+    Memory(const Memory&) = delete;
+    Memory& operator=(const Memory&) = delete;
 
     void attachIRQ(IRQ* i) { irq = i; }
+    void attachCodeTracker(CodeTracker* c);
+
+    // Write-protects a fastmem page while either core has code on it.
+    // 'page' is a physical page (see physical()).
+    void refreshCodePage(uint32_t page);
+
+    // Moves guest memory into a fastmem arena; false if unsupported.
+    // Only the ARM9 bus owns memory it can move.
+    bool enableFastmem();
+
+    // Written on the ARM9 side; remaps both buses
+    void setWRAMCNT(uint8_t v);
+    void remapWRAM(uint8_t v);
+
+    void assignStorage(uint8_t* base);
+    void mapRegions();
+    void mapSharedWRAM();
+
+    // Remaps the TCMs over the rest of the address space. ITCM always
+    // starts at 0 and wins where the two overlap.
+    void setTCM(bool itcmOn, uint32_t itcmSize, bool dtcmOn, uint32_t dtcmBase, uint32_t dtcmSize);
+
+    // Maps [start, end) onto 'host', mirrored every 'size' bytes
+    void map(uint32_t start, uint32_t end, uint8_t* host, uint32_t size, bool writable);
+
+    // Bus attributes for one 16 MiB area of the address space (addr >> 24)
+    struct Region {
+        uint8_t* base = nullptr;    // host memory, null for MMIO/unmapped
+        uint32_t mask = 0;          // mirror mask (size - 1)
+        uint8_t writeWidths = 0;    // bit N set: 1 << N byte writes land
+        uint8_t wait[3] = {};       // cycles per 8/16/32-bit access
+    };
+
+    static constexpr uint8_t WIDTH_8 = 1, WIDTH_16 = 2, WIDTH_32 = 4;
+    static constexpr uint8_t WIDTH_ALL = WIDTH_8 | WIDTH_16 | WIDTH_32;
+
+    Region regions[256];
+
+    // Fills 'regions' and builds the page table from it
+    void setRegion(uint8_t area, uint8_t* base, uint32_t size, uint8_t writeWidths,
+                   uint8_t wait8, uint8_t wait16, uint8_t wait32);
+
+    template <typename T>
+    static constexpr int widthIndex() {
+        static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4);
+        return sizeof(T) == 1 ? 0 : sizeof(T) == 2 ? 1 : 2;
+    }
+
+    template <typename T>
+    uint32_t waitStates(uint32_t addr) const {
+        return regions[addr >> 24].wait[widthIndex<T>()];
+    }
+
+    // The same in ARM9 cycles, the unit the scheduler counts in
+    template <typename T>
+    uint32_t accessCycles(uint32_t addr) const {
+        return waitStates<T>(addr) * BUS_CYCLE;
+    }
+
+    // Accesses are aligned to their width, as on the ARM9 bus. Plain
+    // memory is one host load/store through the page table; everything
+    // else goes to the region's slow path.
+    template <typename T>
+    inline T read(uint32_t addr) {
+        addr &= ~(uint32_t)(sizeof(T) - 1);
+        if (uint8_t* p = readPage[addr >> PAGE_SHIFT]) {
+            T v;
+            memcpy(&v, p + (addr & PAGE_MASK), sizeof(T));
+            return v;
+        }
+        return readSlow<T>(addr);
+    }
+
+    template <typename T>
+    inline void write(uint32_t addr, T v) {
+        addr &= ~(uint32_t)(sizeof(T) - 1);
+        if (uint8_t* p = writePage[addr >> PAGE_SHIFT]) {
+            p += addr & PAGE_MASK;
+            memcpy(p, &v, sizeof(T));
+            codeWritten(physical(p), sizeof(T));
+            return;
+        }
+        writeSlow<T>(addr, v);
+    }
+
+    // Cached code is tracked by where it lives, not by the address it was
+    // fetched through, so a store through any mirror or alias of it (main
+    // RAM and ITCM mirrors, shared memory seen from the other core) finds
+    // it. A physical address is an offset into the ARM9 bus's memory, or
+    // ARM7_PHYS plus an offset into the ARM7's own. Guest addresses with
+    // no memory behind them stand for themselves; area 0 is always
+    // mapped, so they never reach the physical range.
+    inline uint32_t physical(const uint8_t* host) const {
+        uintptr_t off = (uintptr_t)host - (uintptr_t)arm9Memory;
+        if (off < ARM9_MEMORY_SIZE) return (uint32_t)off;
+        return ARM7_PHYS + (uint32_t)((uintptr_t)host - (uintptr_t)bios);
+    }
+
+    inline uint32_t physical(uint32_t addr) const {
+        if (uint8_t* p = readPage[addr >> PAGE_SHIFT])
+            return physical(p + (addr & PAGE_MASK));
+        const Region& r = regions[addr >> 24];
+        return r.base ? physical(r.base + (addr & r.mask)) : addr;
+    }
+
+    // Cached code of either core at physical address 'phys'. Both buses
+    // number shared memory the same way, so the other core's blocks are
+    // checked too.
+    inline bool codeAt(uint32_t phys) const {
+        return (code && code->hasCode(phys)) || (peerCode && peerCode->hasCode(phys));
+    }
+
+    inline bool hasCode(uint32_t addr) const {
+        return codeAt(physical(addr));
+    }
+
+    // 'size' bytes stored at 'phys'. Stores are aligned to their width,
+    // so they never cross a page and one page check covers them.
+    inline void codeWritten(uint32_t phys, uint32_t size) {
+        if (code && code->hasCode(phys)) code->invalidate(phys, size);
+        if (peerCode && peerCode->hasCode(phys)) peerCode->invalidate(phys, size);
+    }
+
+    // Host pointer for [addr, addr + len) when that run is plain memory
+    // inside one page (for writes: one that holds no cached code), so bulk
+    // transfers can skip the per-access checks; null otherwise
+    inline uint8_t* hostSpan(uint32_t addr, uint32_t len, bool write) {
+        if ((addr & PAGE_MASK) + len > PAGE_SIZE) return nullptr;
+        uint8_t* p = (write ? writePage : readPage)[addr >> PAGE_SHIFT];
+        if (!p || (write && codeAt(physical(p)))) return nullptr;
+        return p + (addr & PAGE_MASK);
+    }
+
+    // Like hostSpan, for runs that may cross pages: non-null only when
+    // every page is mapped and contiguous in host memory
+    uint8_t* hostRange(uint32_t addr, uint32_t len, bool write);
+
+    uint8_t  read8(uint32_t addr)  { return read<uint8_t>(addr); }
+    uint16_t read16(uint32_t addr) { return read<uint16_t>(addr); }
+    uint32_t read32(uint32_t addr) { return read<uint32_t>(addr); }
+
+    void write8(uint32_t addr, uint8_t v)   { write<uint8_t>(addr, v); }
+    void write16(uint32_t addr, uint16_t v) { write<uint16_t>(addr, v); }
+    void write32(uint32_t addr, uint32_t v) { write<uint32_t>(addr, v); }
 
-    uint8_t  read8(uint32_t addr);
-    uint16_t read16(uint32_t addr);
-    uint32_t read32(uint32_t addr);
+    // Region-driven fallbacks for pages the page table does not cover
+    template <typename T>
+    T readSlow(uint32_t addr) {
+        const Region& r = regions[addr >> 24];
+        if (r.base) {
+            T v;
+            memcpy(&v, r.base + (addr & r.mask), sizeof(T));
+            return v;
+        }
+        if (MMIO::contains(addr))
+            return mmio.read<T>(addr);
+        return 0;
+    }
 
-    void write8(uint32_t addr, uint8_t v);
-    void write16(uint32_t addr, uint16_t v);
-    void write32(uint32_t addr, uint32_t v);
+    template <typename T>
+    void writeSlow(uint32_t addr, T v) {
+        const Region& r = regions[addr >> 24];
+        if (r.base) {
+            if (!(r.writeWidths & sizeof(T))) return;
+            uint8_t* p = r.base + (addr & r.mask);
+            memcpy(p, &v, sizeof(T));
+            codeWritten(physical(p), sizeof(T));
+            return;
+        }
+        if (MMIO::contains(addr))
+            mmio.write<T>(addr, v);
+    }
 };
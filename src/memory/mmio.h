@@ -0,0 +1,144 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+// IO register dispatch for 0x04000000-0x04001FFF and the receive ports at
+// 0x04100000 (IPC FIFO, game card data). Every 32-bit register
+// slot can carry read/write callbacks per access width; a slot without
+// one keeps its bytes in 'bytes', so plain registers just read back what
+// was written. Subsystems register their own registers in init().
+//
+// Missing widths are composed from the ones a slot does have: a 32-bit
+// access becomes two 16-bit ones, a 16-bit access two 8-bit ones (or half
+// of the 32-bit handler), and a narrow write to a wider handler is merged
+// with the register's current value.
+struct MMIO {
+    static constexpr uint32_t BASE = 0x04000000;
+    static constexpr uint32_t SIZE = 0x2000;
+    static constexpr uint32_t PORT_BASE = 0x04100000;
+    static constexpr uint32_t PORT_SIZE = 0x20;
+
+    template <typename T> using ReadFn = T (*)(void* ctx, uint32_t addr);
+    template <typename T> using WriteFn = void (*)(void* ctx, uint32_t addr, T v);
+
+    uint8_t bytes[SIZE + PORT_SIZE] = {};
+
+    static bool contains(uint32_t addr) {
+        return addr - BASE < SIZE || addr - PORT_BASE < PORT_SIZE;
+    }
+
+    // Index into 'bytes'; the ports follow the main window
+    static uint32_t offset(uint32_t addr) {
+        return addr - BASE < SIZE ? addr - BASE : SIZE + (addr - PORT_BASE);
+    }
+
+    template <typename T>
+    void onRead(uint32_t addr, ReadFn<T> fn, void* ctx) {
+        Slot& s = slot(addr);
+        reader<T>(s) = fn;
+        s.ctx = ctx;
+    }
+
+    template <typename T>
+    void onWrite(uint32_t addr, WriteFn<T> fn, void* ctx) {
+        Slot& s = slot(addr);
+        writer<T>(s) = fn;
+        s.ctx = ctx;
+    }
+
+    // Registers both directions for one width
+    template <typename T>
+    void on(uint32_t addr, ReadFn<T> r, WriteFn<T> w, void* ctx) {
+        onRead<T>(addr, r, ctx);
+        onWrite<T>(addr, w, ctx);
+    }
+
+    // 'addr' must be inside the window and aligned to sizeof(T)
+    template <typename T>
+    T read(uint32_t addr) {
+        const Slot& s = slot(addr);
+        if (ReadFn<T> fn = reader<T>(s))
+            return fn(s.ctx, addr);
+
+        if constexpr (sizeof(T) == 4) {
+            return read<uint16_t>(addr) | ((uint32_t)read<uint16_t>(addr + 2) << 16);
+        }
+        else if constexpr (sizeof(T) == 2) {
+            if (s.r32) return (uint16_t)(s.r32(s.ctx, addr & ~3u) >> ((addr & 2) * 8));
+            return read<uint8_t>(addr) | (read<uint8_t>(addr + 1) << 8);
+        }
+        else {
+            if (s.r16) return (uint8_t)(s.r16(s.ctx, addr & ~1u) >> ((addr & 1) * 8));
+            if (s.r32) return (uint8_t)(s.r32(s.ctx, addr & ~3u) >> ((addr & 3) * 8));
+            return bytes[offset(addr)];
+        }
+    }
+
+    template <typename T>
+    void write(uint32_t addr, T v) {
+        const Slot& s = slot(addr);
+        if (WriteFn<T> fn = writer<T>(s)) {
+            fn(s.ctx, addr, v);
+            return;
+        }
+
+        if constexpr (sizeof(T) == 4) {
+            write<uint16_t>(addr, (uint16_t)v);
+            write<uint16_t>(addr + 2, (uint16_t)(v >> 16));
+        }
+        else if constexpr (sizeof(T) == 2) {
+            if (s.w32) {
+                uint32_t shift = (addr & 2) * 8;
+                uint32_t cur = read<uint32_t>(addr & ~3u);
+                s.w32(s.ctx, addr & ~3u, (cur & ~(0xFFFFu << shift)) | ((uint32_t)v << shift));
+                return;
+            }
+            write<uint8_t>(addr, (uint8_t)v);
+            write<uint8_t>(addr + 1, (uint8_t)(v >> 8));
+        }
+        else {
+            if (s.w16) {
+                uint32_t shift = (addr & 1) * 8;
+                uint16_t cur = read<uint16_t>(addr & ~1u);
+                s.w16(s.ctx, addr & ~1u, (uint16_t)((cur & ~(0xFF << shift)) | (v << shift)));
+                return;
+            }
+            if (s.w32) {
+                uint32_t shift = (addr & 3) * 8;
+                uint32_t cur = read<uint32_t>(addr & ~3u);
+                s.w32(s.ctx, addr & ~3u, (cur & ~(0xFFu << shift)) | ((uint32_t)v << shift));
+                return;
+            }
+            bytes[offset(addr)] = v;
+        }
+    }
+
+private:
+    struct Slot {
+        ReadFn<uint8_t> r8 = nullptr;
+        ReadFn<uint16_t> r16 = nullptr;
+        ReadFn<uint32_t> r32 = nullptr;
+        WriteFn<uint8_t> w8 = nullptr;
+        WriteFn<uint16_t> w16 = nullptr;
+        WriteFn<uint32_t> w32 = nullptr;
+        void* ctx = nullptr;
+    };
+
+    std::vector<Slot> slots = std::vector<Slot>((SIZE + PORT_SIZE) / 4);
+
+    Slot& slot(uint32_t addr) { return slots[offset(addr) >> 2]; }
+
+    template <typename T, typename S>
+    static auto& reader(S& s) {
+        if constexpr (sizeof(T) == 1) return s.r8;
+        else if constexpr (sizeof(T) == 2) return s.r16;
+        else return s.r32;
+    }
+
+    template <typename T, typename S>
+    static auto& writer(S& s) {
+        if constexpr (sizeof(T) == 1) return s.w8;
+        else if constexpr (sizeof(T) == 2) return s.w16;
+        else return s.w32;
+    }
+};
@@ -1,46 +1,161 @@
 #include "timer.h"
 #include "../arm9/irq.h"
+#include "../memory/memory.h"
 
-static constexpr int prescalerTable[4] = { 1, 64, 256, 1024 };
+// Timers count at the bus clock, so each period is its bus-cycle count
+// in ARM9 cycles
+static constexpr int BUS_CYCLE = Memory::BUS_CYCLE;
+static constexpr int prescalerTable[4] = { 1 * BUS_CYCLE, 64 * BUS_CYCLE, 256 * BUS_CYCLE, 1024 * BUS_CYCLE };
+
+static constexpr uint16_t CNT_CASCADE = 1 << 2;
+static constexpr uint16_t CNT_IRQ = 1 << 6;
+static constexpr uint16_t CNT_ENABLE = 1 << 7;
+
+static void onOverflow(void* ctx) {
+    static_cast<Timer*>(ctx)->overflow();
+}
+
+static Scheduler::Event eventFor(int id) {
+    return (Scheduler::Event)(Scheduler::TIMER0 + id);
+}
+
+// TMxCNT_L at +0, TMxCNT_H at +2
+static uint16_t readReg(void* ctx, uint32_t addr) {
+    Timer* t = static_cast<Timer*>(ctx);
+    if (addr & 2) return t->readCNT_H();
+    t->mem->clockRead = true;
+    return t->readCNT_L();
+}
+
+static void writeReg(void* ctx, uint32_t addr, uint16_t v) {
+    Timer* t = static_cast<Timer*>(ctx);
+    if (addr & 2) t->writeCNT_H(v);
+    else t->writeCNT_L(v);
+}
+
+void Timer::init(Memory* memory, int index) {
+    mem = memory;
+    id = index;
+    mem->scheduler.setHandler(eventFor(id), onOverflow, this);
+    mem->mmio.on<uint16_t>(0x04000100 + id * 4, readReg, writeReg, this);
+}
 
 void Timer::reset() {
     reload = counter = control = 0;
-    prescale = 0;
+    base = 0;
+    if (mem) mem->scheduler.cancel(eventFor(id));
 }
 
 void Timer::writeCNT_L(uint16_t v) {
+    // past wraps used the old reload; the next overflow time is unchanged
+    latch(mem->scheduler.now);
     reload = v;
 }
 
 void Timer::writeCNT_H(uint16_t v) {
-    bool wasEnabled = control & (1 << 7);
+    uint64_t now = mem->scheduler.now;
+    uint16_t old = control;
+
+    latch(now);
     control = v;
 
-    if (!wasEnabled && (control & (1 << 7))) {
+    if (!(old & CNT_ENABLE) && (control & CNT_ENABLE)) {
         counter = reload;
-        prescale = 0;
+        base = now;
+    }
+    else if ((old ^ control) & (3 | CNT_CASCADE)) {
+        // new prescaler or source: count from here
+        base = now;
+    }
+
+    // the previous timer may have gained or lost a count-up listener
+    if (id > 0) {
+        Timer& prev = mem->timers[id - 1];
+        prev.latch(now);
+        prev.reschedule();
     }
+
+    reschedule();
 }
 
 uint16_t Timer::readCNT_L() const {
-    return counter;
+    return value(mem->scheduler.now);
 }
 
 uint16_t Timer::readCNT_H() const {
     return control;
 }
 
-void Timer::step(IRQ* irq, int id) {
-    if (!(control & (1 << 7))) return;
+bool Timer::running() const {
+    return (control & CNT_ENABLE) && !cascade();
+}
+
+// Timer 0 has no previous timer to count up from
+bool Timer::cascade() const {
+    return id > 0 && (control & CNT_CASCADE);
+}
+
+bool Timer::needsEvent() const {
+    if (control & CNT_IRQ) return true;
+    if (id == 3) return false;
+
+    const Timer& next = mem->timers[id + 1];
+    return (next.control & CNT_ENABLE) && next.cascade();
+}
+
+uint16_t Timer::value(uint64_t now) const {
+    if (!running()) return counter;
+
+    uint64_t ticks = (now - base) / prescalerTable[control & 3];
+    uint32_t left = 0x10000 - counter;
+    if (ticks < left)
+        return (uint16_t)(counter + ticks);
+
+    // wrapped (possibly many times) around reload without an event
+    ticks -= left;
+    return (uint16_t)(reload + ticks % (0x10000 - reload));
+}
+
+// Re-bases the counter at 'now', keeping the prescaler phase
+void Timer::latch(uint64_t now) {
+    if (!running()) return;
 
-    prescale++;
-    if (prescale < prescalerTable[control & 3]) return;
-    prescale = 0;
+    int div = prescalerTable[control & 3];
+    counter = value(now);
+    base = now - (now - base) % div;
+}
 
-    counter++;
-    if (counter == 0) {
+void Timer::overflow() {
+    base = mem->scheduler.time(eventFor(id));
+    counter = reload;
+    overflowed();
+    reschedule();
+}
+
+void Timer::countUp() {
+    if (++counter == 0) {
         counter = reload;
-        if (control & (1 << 6))
-            irq->request(1 << (3 + id)); // TIMER0 = bit 3
+        overflowed();
+    }
+}
+
+void Timer::overflowed() {
+    if ((control & CNT_IRQ) && mem->irq)
+        mem->irq->request(1 << (3 + id)); // TIMER0 = bit 3
+
+    if (id < 3) {
+        Timer& next = mem->timers[id + 1];
+        if ((next.control & CNT_ENABLE) && next.cascade())
+            next.countUp();
     }
 }
+
+void Timer::reschedule() {
+    if (!running() || !needsEvent()) {
+        mem->scheduler.cancel(eventFor(id));
+        return;
+    }
+
+    uint64_t ticks = 0x10000 - counter;
+    mem->scheduler.scheduleAt(eventFor(id), base + ticks * prescalerTable[control & 3]);
+}
@@ -1,19 +1,41 @@
 #pragma once
 #include <cstdint>
 
-struct IRQ;
+struct Memory;
 
+// Timers are not ticked. While running, the counter is derived from the
+// scheduler clock: 'counter' was the value at time 'base', and one tick
+// follows every prescaler period after that. An overflow event is only
+// scheduled when something observes it (the IRQ, or a count-up timer).
 struct Timer {
     uint16_t reload = 0;
     uint16_t counter = 0;
     uint16_t control = 0;
-    uint32_t prescale = 0;
+    uint64_t base = 0;          // scheduler time 'counter' refers to
 
+    Memory* mem = nullptr;
+    int id = 0;
+
+    void init(Memory* memory, int index);
     void reset();
     void writeCNT_L(uint16_t v);
     void writeCNT_H(uint16_t v);
     uint16_t readCNT_L() const;
     uint16_t readCNT_H() const;
 
-    void step(IRQ* irq, int id);
+    // Counter value at scheduler time 'now'
+    uint16_t value(uint64_t now) const;
+
+    // Overflow event: the counter wrapped exactly at its scheduled time
+    void overflow();
+
+private:
+    bool running() const;
+    bool cascade() const;
+    bool needsEvent() const;
+
+    void latch(uint64_t now);
+    void countUp();
+    void overflowed();
+    void reschedule();
 };
@@ -0,0 +1,58 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// Fixed-size single-producer single-consumer queue. Each index is only
+// written by its own side, so push and pop take no lock: the release
+// store of an index hands over the slot it covers. N must be a power of
+// two; the indices run freely and wrap at 2^32.
+template <typename T, uint32_t N>
+struct SPSCRing {
+    static_assert(N && (N & (N - 1)) == 0, "N must be a power of two");
+
+    // Producer side; false when full
+    bool push(const T& v) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) return false;
+        items[t & (N - 1)] = v;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side; false when empty
+    bool pop(T& v) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (tail.load(std::memory_order_acquire) == h) return false;
+        v = items[h & (N - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side: the oldest entry, which stays queued
+    bool peek(T& v) const {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (tail.load(std::memory_order_acquire) == h) return false;
+        v = items[h & (N - 1)];
+        return true;
+    }
+
+    // Either side may ask; the answer can be stale by the time it is used
+    uint32_t size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    bool empty() const { return size() == 0; }
+    bool full() const { return size() == N; }
+
+    // Only while neither side is using the ring
+    void clear() {
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    // Apart, so the two sides do not share a cache line
+    alignas(64) std::atomic<uint32_t> head{ 0 };
+    alignas(64) std::atomic<uint32_t> tail{ 0 };
+    T items[N];
+};